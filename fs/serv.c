@@ -336,38 +336,60 @@ fshandler handlers[] = {
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Requests small enough for the client to send as message words
+// (see fsipc_words in lib/file.c) instead of an argument page.
+static bool
+word_request(uint32_t req)
+{
+	return req == FSREQ_FLUSH || req == FSREQ_SET_SIZE
+		|| req == FSREQ_SYNC;
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	uint32_t req, whom = 0;
+	int perm = 0, r = 0;
+	void *pg = NULL;
+	static uint32_t reqwords[IPC_NWORDS];
+	union Fsipc *args;
 
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		// Reply to the last request, if there was one, and wait for
+		// the next
+		req = ipc_reply_wait(whom, r, pg, perm,
+				     (int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, vpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// All requests must contain an argument page, except short
+		// ones, whose arguments may come in the message words
+		if (perm & PTE_P) {
+			args = fsreq;
+		} else if (word_request(req)) {
+			memset(reqwords, 0, sizeof(reqwords));
+			memmove(reqwords, (const void *) thisenv->env_ipc_words,
+				thisenv->env_ipc_nwords * sizeof(uint32_t));
+			args = (union Fsipc *) reqwords;
+		} else {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
+			whom = 0;
 			continue; // just leave it hanging...
 		}
 
 		pg = NULL;
 		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+			r = serve_open(whom, (struct Fsreq_open*)args, &pg, &perm);
 		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
+			r = handlers[req](whom, args);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", whom, req);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (args == fsreq)
+			sys_page_unmap(0, fsreq);
 	}
 }
 
@@ -0,0 +1,44 @@
+// Shared-memory ring channels between two environments.
+
+#ifndef JOS_INC_CHAN_H
+#define JOS_INC_CHAN_H
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+
+// Largest message a channel slot holds
+#define CHAN_MSGSIZE	60
+#define CHAN_NSLOTS	(PGSIZE / sizeof(struct ChanSlot))
+// Pages shared by the two ends, as mapped by sys_chan_create
+#define CHAN_NPAGES	(sizeof(struct Chan) / PGSIZE)
+
+#define CHAN_CACHELINE	64
+
+struct ChanSlot {
+	uint32_t cs_len;
+	uint8_t cs_data[CHAN_MSGSIZE];
+};
+
+// A single-producer, single-consumer ring of CHAN_NSLOTS messages.  The
+// first page holds the indices, each written by only one end and kept
+// on its own cache line; the second holds the slots.  The indices run
+// freely, so the ring is empty when they are equal and full when they
+// are CHAN_NSLOTS apart.  An end that finds the ring empty (or full)
+// sets its waiting flag and sleeps in sys_futex_wait on the other end's
+// index; the other end clears the flag and wakes it after moving that
+// index (see lib/ipc.c).
+struct Chan {
+	// Receiver's end
+	volatile uint32_t ch_head;		// Next slot to receive
+	volatile uint32_t ch_recv_waiting;	// Receiver asleep on ch_tail
+	uint8_t ch_pad0[CHAN_CACHELINE - 2 * sizeof(uint32_t)];
+
+	// Sender's end
+	volatile uint32_t ch_tail;		// Next slot to send into
+	volatile uint32_t ch_send_waiting;	// Sender asleep on ch_head
+	uint8_t ch_pad1[PGSIZE - CHAN_CACHELINE - 2 * sizeof(uint32_t)];
+
+	struct ChanSlot ch_slots[CHAN_NSLOTS];
+};
+
+#endif /* !JOS_INC_CHAN_H */
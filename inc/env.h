@@ -9,6 +9,9 @@
 
 typedef int32_t envid_t;
 
+struct sched_timeout;
+struct ipc_queue;
+
 // An environment ID 'envid_t' has three parts:
 //
 // +1+---------------21-----------------+--------10--------+
@@ -46,6 +49,44 @@ enum EnvType {
 	ENV_TYPE_NS,		// Network server
 };
 
+// Scheduling priorities, which are also the levels of the scheduler's
+// multi-level feedback queue: lower numbers run first.  An env's level
+// drops below its priority while it uses up whole time slices and goes
+// back up when it wakes from an IPC receive.
+#define ENV_NPRIO		4
+#define ENV_PRIO_HIGH		0	// Servers: fs, ns and their helpers
+#define ENV_PRIO_NORMAL		1	// Default for user environments
+#define ENV_PRIO_LOW		(ENV_NPRIO - 1)
+
+// Most words an IPC message can carry in place of a page
+#define IPC_NWORDS		6
+
+// Flag for the perm argument of the IPC send syscalls: move the page to
+// the receiver, unmapping it from the sender, instead of sharing it.
+// It is outside PTE_SYSCALL, so it never reaches a page table.
+#define IPC_MOVE		0x100
+
+// One message received by sys_ipc_recv_batch: the ipc fields of struct
+// Env that sys_ipc_recv would have left for it
+struct IpcMsg {
+	envid_t im_from;
+	uint32_t im_value;
+	int im_perm;
+	int im_nwords;
+	uint32_t im_words[IPC_NWORDS];
+};
+
+// A range of demand-zero anonymous memory.  Pages in [ar_start, ar_end)
+// are allocated zeroed, with permission ar_perm, when first touched.
+// A slot with ar_start == ar_end is unused.
+struct AnonRegion {
+	uintptr_t ar_start;
+	uintptr_t ar_end;
+	int ar_perm;
+};
+
+#define NANONREGION		8
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
@@ -55,12 +96,21 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	struct Env *env_rq_next;	// Links on a CPU's run queue
+	struct Env *env_rq_prev;
+	int env_rq_cpu;			// CPU whose run queue holds us, or -1
+	int env_prio;			// Base priority (ENV_PRIO_*)
+	int env_level;			// Current MLFQ level, >= env_prio
+	uint32_t env_affinity;		// CPUs we may run on, bit i for CPU i
+	struct sched_timeout *env_timeout; // See kern/sched.c, or NULL
 
 	// LAB3: might need code here for implementation of sbrk
   uint32_t env_break;
+	struct AnonRegion env_anon[NANONREGION];	// Demand-zero regions
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
+	int env_pgcolor;		// Page color to allocate from, or -1
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
@@ -71,6 +121,27 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	envid_t env_ipc_recv_from;	// Only sender we accept, or 0 for any
+	int env_ipc_nwords;		// Number of message words received
+	uint32_t env_ipc_words[IPC_NWORDS];
+	struct ipc_queue *env_ipc_queue; // Messages queued for us, or NULL
+
+	// Blocking send (see kern/ipc.c)
+	struct Env *env_ipc_sendq;	// Senders blocked on us, oldest first
+	struct Env *env_ipc_sendq_tail;
+	struct Env *env_ipc_send_next;	// Link on our receiver's sendq
+	struct Env *env_ipc_send_to;	// Receiver we are blocked on, or NULL
+	int env_ipc_send_then;		// What to do once it has received
+	uint32_t env_ipc_send_value;	// The message we are blocked sending
+	void *env_ipc_send_srcva;
+	int env_ipc_send_perm;
+	int env_ipc_send_nwords;
+	uint32_t env_ipc_send_words[IPC_NWORDS];
+
+	// Futex wait (see kern/futex.c)
+	physaddr_t env_futex_pa;	// Word we are blocked on, or 0
+	struct Env *env_futex_next;	// Links on that word's hash chain
+	struct Env *env_futex_prev;
 
 	// LAB3: might need code here for implementation of sbrk
 
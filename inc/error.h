@@ -29,6 +29,9 @@ enum {
   E_TX_QUEUE_FULL = 16, // The transmit queue is full
   E_RCV_QUEUE_EMPTY = 17, // The receive queue is empty
 
+	E_AGAIN		= 18,	// Futex word changed before we could wait
+	E_TIMEOUT	= 19,	// Deadline passed before we were woken
+
 	MAXERROR
 };
 
@@ -24,6 +24,7 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/chan.h>
 
 #define USED(x)		(void)(x)
 
@@ -58,12 +59,36 @@ static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
+int	sys_env_set_priority(envid_t env, int prio);
+int	sys_env_set_affinity(envid_t env, uint32_t mask);
+int	sys_sleep_until(uint64_t deadline);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, uint64_t deadline);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_large(envid_t env, void *va, int perm);
+envid_t	sys_fork_cow(void);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_alloc_range(envid_t env, void *va, size_t npages, int perm);
+int	sys_page_map_range(envid_t src_env, void *src_va,
+			   envid_t dst_env, void *dst_va, size_t npages, int perm);
+int	sys_page_unmap_range(envid_t env, void *va, size_t npages);
+int	sys_page_reserve(envid_t env, void *va, size_t npages, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_batch(void *rcv_pg, struct IpcMsg *msgs, int n);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm,
+		     uint64_t deadline);
+int32_t	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
+int32_t	sys_ipc_callw(envid_t to_env, uint32_t value, const uint32_t *words,
+		      int nwords, void *rcv_pg);
+int	sys_ipc_reply_waitw(envid_t to_env, uint32_t value,
+			    const uint32_t *words, int nwords, void *rcv_pg);
+int	sys_chan_create(envid_t peer, void *va, void *peer_va);
 unsigned int sys_time_msec(void);
 int sys_net_try_transmit(const char * buf, uint32_t len);
 int sys_net_try_receive(char * buf);
@@ -85,11 +110,22 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int	ipc_recv_batch(void *pg, struct IpcMsg *msgs, int n);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_wait(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+int32_t ipc_callw(envid_t to_env, uint32_t value, const void *words,
+		  size_t len);
+int	chan_create(envid_t peer, struct Chan *ch, struct Chan *peer_ch);
+int	chan_send(struct Chan *ch, const void *msg, size_t len);
+int	chan_recv(struct Chan *ch, void *buf, size_t len);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);
 envid_t	sfork(void);	// Challenge!
 
 int     sys_map_kernel_page(void* kpage, void* va);
@@ -142,6 +178,10 @@ envid_t	spawnl(const char *program, const char *arg0, ...);
 envid_t	exec(const char *program, const char **argv);
 envid_t	execl(const char *program, const char *arg0, ...);
 
+// time.c
+unsigned int	time_msec(void);
+uint64_t	time_nsec(void);
+
 
 
 /* File open modes */
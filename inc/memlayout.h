@@ -52,6 +52,8 @@
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
  *    UPAGES    ---->  +------------------------------+ 0xef000000
+ *                     |      RO time page (UTIME)    | R-/R-  PGSIZE
+ *                     | - - - - - - - - - - - - - - -|
  *                     |           RO ENVS            | R-/R-  PTSIZE
  * UTOP,UENVS ------>  +------------------------------+ 0xeec00000
  * UXSTACKTOP -/       |     User Exception Stack     | RW/RW  PGSIZE
@@ -112,6 +114,8 @@
 #define UPAGES		(UVPT - PTSIZE)
 // Read-only copies of the global env structures
 #define UENVS		(UPAGES - PTSIZE)
+// The kernel's clock (struct TimePage), in the last page of the UENVS slot
+#define UTIME		(UPAGES - PGSIZE)
 
 /*
  * Top of user VM. User can manipulate VA from UTOP-1 and down!
@@ -179,8 +183,12 @@ extern volatile pde_t vpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct Page {
-	// Next page on the free list.
+	// Next block on the buddy free list, or the next page of a
+	// chain returned by page_alloc_npages.
 	struct Page *pp_link;
+	// Link field of the previous block on the buddy free list,
+	// so a block can be unlinked in O(1) when it is coalesced.
+	struct Page **pp_pprev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -188,7 +196,16 @@ struct Page {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, only meaningful for the first page of
+	// a free block: PP_BUDDY_FREE is set and the block spans
+	// 2^pp_order pages.
+	uint8_t pp_order;
+	uint8_t pp_flags;
 };
 
+#define PP_BUDDY_FREE	0x1
+#define PP_LARGE	0x2	// Allocated 4MB superpage, freed as a whole
+
 #endif /* !__ASSEMBLER__ */
 #endif /* !JOS_INC_MEMLAYOUT_H */
@@ -65,12 +65,14 @@
 #define PTE_PS		0x080	// Page Size
 #define PTE_G		0x100	// Global
 
-// The PTE_AVAIL bits aren't used by the kernel or interpreted by the
-// hardware, so user processes are allowed to set them arbitrarily.
+// The PTE_AVAIL bits aren't interpreted by the hardware.  The kernel
+// keeps PTE_KCOW for itself; user processes are allowed to set the
+// others arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
+#define PTE_KCOW	0x200	// Copy-on-write, resolved by the kernel
 
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
-#define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
+#define PTE_SYSCALL	((PTE_AVAIL & ~PTE_KCOW) | PTE_P | PTE_W | PTE_U)
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF)
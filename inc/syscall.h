@@ -28,6 +28,22 @@ enum {
   SYS_net_try_transmit,
   SYS_net_try_receive,
   SYS_net_mac,
+	SYS_page_alloc_large,
+	SYS_fork_cow,
+	SYS_page_alloc_range,
+	SYS_page_map_range,
+	SYS_page_unmap_range,
+	SYS_page_reserve,
+	SYS_env_set_priority,
+	SYS_env_set_affinity,
+	SYS_sleep_until,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_wait,
+	SYS_chan_create,
+	SYS_ipc_recv_batch,
 	NSYSCALLS
 };
 
@@ -0,0 +1,27 @@
+#ifndef JOS_INC_TIME_H
+#define JOS_INC_TIME_H
+
+#include <inc/types.h>
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+
+// The kernel's clock, published read-only to every environment at UTIME
+// so that reading the time needs no system call (see lib/time.c).  Time
+// is counted in TSC cycles since tp_tsc_base, at the rate the kernel
+// calibrated against the PIT at boot.  The kernel fills the page in
+// before any environment runs and never changes it afterwards.
+struct TimePage {
+	uint64_t tp_tsc_base;		// TSC reading at time 0
+	uint64_t tp_tsc_hz;		// TSC cycles per second
+};
+
+// Convert a count of TSC cycles at hz cycles per second to nanoseconds,
+// without overflowing for any uptime we care about.
+static __inline uint64_t
+tsc_to_nsec(uint64_t cycles, uint64_t hz)
+{
+	return cycles / hz * NSEC_PER_SEC + cycles % hz * NSEC_PER_SEC / hz;
+}
+
+#endif /* !JOS_INC_TIME_H */
@@ -6,6 +6,7 @@
 #include <inc/memlayout.h>
 #include <inc/mmu.h>
 #include <inc/env.h>
+#include <kern/spinlock.h>
 
 // Maximum number of CPUs
 #define NCPU  8
@@ -14,6 +15,7 @@
 enum {
 	CPU_UNUSED = 0,
 	CPU_STARTED,
+	CPU_HALTED,     // Idle in sched_halt, waiting for an interrupt
 };
 
 // Per-CPU state
@@ -22,6 +24,19 @@ struct Cpu {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct Page *cpu_pages;         // Magazine of free pages (see pmap.c)
+	int cpu_npages;                 // Number of pages in cpu_pages
+	int cpu_tlb_batch;              // Nesting depth of tlb_batch_begin
+	bool cpu_tlb_pending;           // A flush was deferred by the batch
+	struct Env *cpu_rq_head[ENV_NPRIO]; // Runnable envs waiting for this
+	struct Env *cpu_rq_tail[ENV_NPRIO]; // CPU, one queue per MLFQ level
+	int cpu_rq_len;                 // Envs on all of this CPU's queues
+	uint32_t cpu_ticks;             // Time slices used up on this CPU
+	bool cpu_resched;               // Reschedule before leaving trap()
+	uint32_t cpu_migrations;        // Envs run here after last running elsewhere
+#ifdef USE_MCS_SPIN_LOCK
+	struct mcs_node cpu_mcs[MCS_NNODE]; // Queue nodes for the locks we take
+#endif
 };
 
 // Initialized in mpconfig.c
@@ -41,5 +56,9 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_free_run(void);
+uint32_t lapic_timer_count(void);
+void lapic_timer_oneshot(uint32_t count);
 
 #endif
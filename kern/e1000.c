@@ -4,6 +4,7 @@
 #include <inc/x86.h>
 #include <inc/error.h>
 #include <inc/string.h>
+#include <kern/spinlock.h>
 
 static volatile char *e1000_bar0 = (char *)KSTACKTOP;
 static volatile struct tx_desc *tx_descs = (struct tx_desc *)(IOMEMBASE - DMA_PAGES * PGSIZE);
@@ -12,6 +13,18 @@ static volatile struct rcv_desc *rcv_descs = (struct rcv_desc *)(IOMEMBASE - (DM
 static volatile struct rcv_pkt *rcv_pkts = (struct rcv_pkt *)(IOMEMBASE - (DMA_PAGES - 768) * PGSIZE);
 extern size_t npages;			// Amount of physical memory (in pages)
 
+// The transmit and receive rings are independent, so each has its own lock
+static struct spinlock tx_lock = {
+#ifdef DEBUG_SPINLOCK
+  .name = "e1000_tx_lock"
+#endif
+};
+static struct spinlock rcv_lock = {
+#ifdef DEBUG_SPINLOCK
+  .name = "e1000_rcv_lock"
+#endif
+};
+
 uint8_t e1000_mac[6];
 
 static uint16_t e1000_read_eeprom(uint8_t addr)
@@ -44,9 +57,12 @@ int e1000_transmit(const char * buf, uint32_t len)
     return -E_INVAL;
 
   volatile uint32_t *tdt = (uint32_t *)(e1000_bar0 + E1000_TDT);
+  spin_lock(&tx_lock);
   uint32_t cur = *tdt;
-  if (!(tx_descs[cur].status & E1000_TXDESC_STATUS_DD))
+  if (!(tx_descs[cur].status & E1000_TXDESC_STATUS_DD)) {
+    spin_unlock(&tx_lock);
     return -E_TX_QUEUE_FULL;
+  }
 
   memmove((void *)tx_pkts[cur].pkt, buf, len);
   tx_descs[cur].length = len;
@@ -58,6 +74,7 @@ int e1000_transmit(const char * buf, uint32_t len)
   if (next == E1000_NTXDESC)
     next = 0;
   *tdt = next;
+  spin_unlock(&tx_lock);
   return 0;
 }
 
@@ -65,16 +82,20 @@ int e1000_receive(char * buf)
 {
   int len;
   volatile uint32_t *rdt = (uint32_t *)(e1000_bar0 + E1000_RDT);
+  spin_lock(&rcv_lock);
   uint32_t cur = (*rdt + 1) % E1000_NRCVDESC;
 
-  if (!(rcv_descs[cur].status & E1000_RCVDESC_STATUS_DD))
+  if (!(rcv_descs[cur].status & E1000_RCVDESC_STATUS_DD)) {
+    spin_unlock(&rcv_lock);
     return -E_RCV_QUEUE_EMPTY;
+  }
 
   len = rcv_descs[cur].length;
   memmove(buf, (void *)rcv_pkts[cur].pkt, len);
   rcv_descs[cur].status &= ~E1000_RCVDESC_STATUS_DD;
 
   *rdt = cur;
+  spin_unlock(&rcv_lock);
   return len;
 }
 
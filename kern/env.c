@@ -14,6 +14,8 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -128,6 +130,9 @@ env_init(void)
                 }
                 envs[i].env_id = 0;
                 envs[i].env_status = ENV_FREE;
+                envs[i].env_rq_cpu = -1;
+                envs[i].env_timeout = NULL;
+                envs[i].env_ipc_queue = NULL;
         }
         env_free_list = envs;
 
@@ -217,6 +222,7 @@ env_setup_vm(struct Env *e)
 int
 env_alloc(struct Env **newenv_store, envid_t parent_id)
 {
+	static unsigned next_pgcolor;
 	int32_t generation;
 	int r;
 	struct Env *e;
@@ -237,8 +243,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	// Not runnable until the caller has set it up
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
+	e->env_prio = e->env_level = ENV_PRIO_NORMAL;
+	e->env_affinity = ~0;
+
+	// With page coloring on, hand out page colors round-robin so that
+	// envs scheduled together land in different slices of the cache.
+	e->env_pgcolor = page_coloring ? next_pgcolor++ % NPGCOLOR : -1;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -269,6 +282,13 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_sendq = e->env_ipc_sendq_tail = NULL;
+	e->env_ipc_send_to = NULL;
+	e->env_ipc_recv_from = 0;
+	e->env_futex_pa = 0;
+
+	// No demand-zero memory until the env reserves some.
+	memset(e->env_anon, 0, sizeof(e->env_anon));
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -278,6 +298,109 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	return 0;
 }
 
+//
+// Reserve [va, va + len) in environment e as demand-zero anonymous
+// memory with permission 'perm'.  Nothing is allocated here: each page
+// is allocated and zeroed by region_fault when it is first touched.
+// va and len must be page aligned.  A reservation that directly extends
+// an existing region with the same permission grows that region.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL if the range is not page-aligned, crosses UTOP, or
+//     overlaps an existing region.
+//   -E_NO_MEM if e has no free region slots.
+//
+int
+region_reserve(struct Env *e, void *va, size_t len, int perm)
+{
+        uintptr_t start = (uintptr_t)va, end = start + len;
+        struct AnonRegion *ar, *slot = NULL;
+
+        if (start % PGSIZE || len % PGSIZE || end < start || end > UTOP) {
+                return -E_INVAL;
+        }
+        if (len == 0) {
+                return 0;
+        }
+        for (ar = e->env_anon; ar < e->env_anon + NANONREGION; ar++) {
+                if (ar->ar_start == ar->ar_end) {
+                        if (!slot) {
+                                slot = ar;
+                        }
+                        continue;
+                }
+                if (start < ar->ar_end && ar->ar_start < end) {
+                        return -E_INVAL;
+                }
+        }
+        for (ar = e->env_anon; ar < e->env_anon + NANONREGION; ar++) {
+                if (ar->ar_start != ar->ar_end && ar->ar_end == start
+                    && ar->ar_perm == perm) {
+                        ar->ar_end = end;
+                        return 0;
+                }
+        }
+        if (!slot) {
+                return -E_NO_MEM;
+        }
+        slot->ar_start = start;
+        slot->ar_end = end;
+        slot->ar_perm = perm;
+        return 0;
+}
+
+//
+// Handle a fault on an unmapped page at 'va' in environment e.  If va
+// lies in one of e's demand-zero regions, map a fresh zeroed page there
+// for a write, or the shared zero page, read-only and PTE_KCOW, for a
+// read.
+//
+// RETURNS:
+//   0 if the page is now mapped
+//   -E_FAULT if va isn't in a demand-zero region, or is already mapped
+//   -E_NO_MEM if there was no memory for the page
+//
+int
+region_fault(struct Env *e, uintptr_t va, bool write)
+{
+        struct AnonRegion *ar;
+        struct Page *pp;
+        pte_t *pte;
+        int perm;
+
+        for (ar = e->env_anon; ar < e->env_anon + NANONREGION; ar++) {
+                if (ar->ar_start <= va && va < ar->ar_end) {
+                        break;
+                }
+        }
+        if (ar == e->env_anon + NANONREGION) {
+                return -E_FAULT;
+        }
+        pte = pgdir_walk(e->env_pgdir, (void *)va, 0);
+        if (pte && (*pte & PTE_P)) {
+                return -E_FAULT;
+        }
+        if (!write) {
+                perm = ar->ar_perm;
+                if (perm & PTE_W) {
+                        perm = (perm & ~PTE_W) | PTE_KCOW;
+                }
+                return page_insert(e->env_pgdir, zero_page,
+                                   (void *)ROUNDDOWN(va, PGSIZE), perm);
+        }
+        pp = page_alloc_env(e, ALLOC_ZERO);
+        if (!pp) {
+                return -E_NO_MEM;
+        }
+        if (page_insert(e->env_pgdir, pp, (void *)ROUNDDOWN(va, PGSIZE),
+                        ar->ar_perm | PTE_U | PTE_P) < 0) {
+                page_free(pp);
+                return -E_NO_MEM;
+        }
+        return 0;
+}
+
 //
 // Allocate len bytes of physical memory for environment env,
 // and map it at virtual address va in the environment's address space.
@@ -299,7 +422,7 @@ region_alloc(struct Env *e, void *va, size_t len)
         size_t size = (uintptr_t)va - vaddr + len;
         uintptr_t off = 0;
         while (off < size) {
-                struct Page* pp = page_alloc(0);
+                struct Page* pp = page_alloc_env(e, 0);
                 if (pp == NULL) {
                         panic("region_alloc: failed\n");
                 }
@@ -382,9 +505,22 @@ load_icode(struct Env *e, uint8_t *binary, size_t size)
                         if (ph->p_va + ph->p_memsz > e->env_break) {
                                 e->env_break = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
                         }
-                        region_alloc(e, (void *)ph->p_va, ph->p_memsz);
-                        memmove((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
-                        memset((void *)(ph->p_va + ph->p_filesz), 0, ph->p_memsz - ph->p_filesz);
+                        // Only pages holding file data are allocated now;
+                        // the pages of bss past them are demand-zero
+                        uintptr_t fileend = ph->p_filesz ?
+                                ROUNDUP(ph->p_va + ph->p_filesz, PGSIZE) :
+                                ROUNDDOWN(ph->p_va, PGSIZE);
+                        uintptr_t memend = ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE);
+                        if (region_reserve(e, (void *)fileend, memend - fileend,
+                                           PTE_U | PTE_W | PTE_P) < 0) {
+                                fileend = memend;
+                        }
+                        if (fileend > ph->p_va) {
+                                region_alloc(e, (void *)ph->p_va, fileend - ph->p_va);
+                                memmove((void *)ph->p_va, binary + ph->p_offset, ph->p_filesz);
+                                memset((void *)(ph->p_va + ph->p_filesz), 0,
+                                       fileend - (ph->p_va + ph->p_filesz));
+                        }
                 }
         }
         e->env_tf.tf_eip = elf->e_entry;
@@ -417,6 +553,11 @@ env_create(uint8_t *binary, size_t size, enum EnvType type)
         if (type == ENV_TYPE_FS) {
           e->env_tf.tf_eflags |= FL_IOPL_3;
         }
+        // Servers are latency-sensitive and mostly blocked in IPC
+        if (type == ENV_TYPE_FS || type == ENV_TYPE_NS) {
+                sched_set_priority(e, ENV_PRIO_HIGH);
+        }
+        sched_set_status(e, ENV_RUNNABLE);
 }
 
 //
@@ -446,6 +587,14 @@ env_free(struct Env *e)
 		if (!(e->env_pgdir[pdeno] & PTE_P))
 			continue;
 
+		// a superpage has no page table, just drop the mapping
+		if (e->env_pgdir[pdeno] & PTE_PS) {
+			pa = PTE_ADDR(e->env_pgdir[pdeno]);
+			e->env_pgdir[pdeno] = 0;
+			page_decref(pa2page(pa));
+			continue;
+		}
+
 		// find the pa and va of the page table
 		pa = PTE_ADDR(e->env_pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
@@ -466,8 +615,14 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+	// Stop waiting on any futex or to send, fail the sends of those
+	// waiting to send to us, and give back our timeout.
+	futex_cancel(e);
+	ipc_env_free(e);
+	sched_timeout_free(e);
+
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	sched_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
 }
@@ -484,7 +639,7 @@ env_destroy(struct Env *e)
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
 	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+		sched_set_status(e, ENV_DYING);
 		return;
 	}
 
@@ -548,13 +703,17 @@ env_run(struct Env *e)
 
         if (curenv != e) {
                 if (curenv && curenv->env_status == ENV_RUNNING) {
-                        curenv->env_status = ENV_RUNNABLE;
+                        sched_set_status(curenv, ENV_RUNNABLE);
                 }
+                if (e->env_runs > 0 && e->env_cpunum != cpunum())
+                        thiscpu->cpu_migrations++;
                 curenv = e;
-                curenv->env_status = ENV_RUNNING;
                 curenv->env_runs++;
                 lcr3(PADDR(curenv->env_pgdir));
         }
+        if (curenv->env_status != ENV_RUNNING) {
+                sched_set_status(curenv, ENV_RUNNING);
+        }
         env_pop_tf(&curenv->env_tf);
 }
 
@@ -23,6 +23,8 @@ void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
 void region_alloc(struct Env *e, void *va, size_t len);
+int region_reserve(struct Env *e, void *va, size_t len, int perm);
+int region_fault(struct Env *e, uintptr_t va, bool write);
 
 // Without this extra macro, we couldn't pass macros like TEST to
 // ENV_CREATE because of the C pre-processor's argument prescan rule.
@@ -0,0 +1,192 @@
+// Futexes: wait queues for user words, keyed by the word's physical
+// address so that envs sharing a page can wait on and wake each other
+// through it whatever address each maps it at.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+
+#include <kern/futex.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/time.h>
+
+#define NFUTEXHASH	64
+#define FUTEX_HASH(pa)	(((pa) >> 2) % NFUTEXHASH)
+
+// The envs waiting on the words that hash to one chain, oldest first,
+// so that futex_wake wakes waiters in the order they blocked.
+struct futex_chain {
+	struct Env *fc_head;
+	struct Env *fc_tail;
+};
+
+// Protects the chains and the env_futex_* fields of every env.  Taken
+// before sched_lock and the timer heap locks.
+static struct spinlock futex_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "futex_lock"
+#endif
+};
+
+static struct futex_chain chains[NFUTEXHASH];
+
+// Find the physical address of the word at addr in e's address space.
+// Any user-readable word will do, including those in UENVS and UPAGES.
+static int
+futex_key(struct Env *e, uint32_t *addr, physaddr_t *pa_store)
+{
+	uintptr_t va = (uintptr_t) addr;
+	pte_t *pte;
+
+	if (va % sizeof(uint32_t) || va >= ULIM)
+		return -E_INVAL;
+	if (page_lookup(e->env_pgdir, addr, &pte) == NULL || !(*pte & PTE_U))
+		return -E_FAULT;
+	if (*pte & PTE_PS)
+		*pa_store = PTE_ADDR(*pte) + (va & (PTSIZE - 1));
+	else
+		*pa_store = PTE_ADDR(*pte) + PGOFF(va);
+	return 0;
+}
+
+static void
+futex_enqueue(struct Env *e, physaddr_t pa)
+{
+	struct futex_chain *fc = &chains[FUTEX_HASH(pa)];
+
+	e->env_futex_pa = pa;
+	e->env_futex_next = NULL;
+	e->env_futex_prev = fc->fc_tail;
+	if (fc->fc_tail)
+		fc->fc_tail->env_futex_next = e;
+	else
+		fc->fc_head = e;
+	fc->fc_tail = e;
+}
+
+static void
+futex_dequeue(struct Env *e)
+{
+	struct futex_chain *fc = &chains[FUTEX_HASH(e->env_futex_pa)];
+
+	if (e->env_futex_prev)
+		e->env_futex_prev->env_futex_next = e->env_futex_next;
+	else
+		fc->fc_head = e->env_futex_next;
+	if (e->env_futex_next)
+		e->env_futex_next->env_futex_prev = e->env_futex_prev;
+	else
+		fc->fc_tail = e->env_futex_prev;
+	e->env_futex_pa = 0;
+}
+
+// Make waiter e, which is off its chain, runnable again.
+static void
+futex_resume(struct Env *e)
+{
+	if (e->env_status == ENV_NOT_RUNNABLE)
+		sched_wakeup(e);
+}
+
+static void
+futex_expire(struct Env *e)
+{
+	spin_lock(&futex_lock);
+	if (e->env_futex_pa) {
+		futex_dequeue(e);
+		futex_resume(e);
+	}
+	spin_unlock(&futex_lock);
+}
+
+// Block e on the word at addr, as long as that word still holds val,
+// until futex_wake or until time_nsec() reaches deadline (0 for no
+// timeout).  When e runs again its syscall returns 0 if it was woken
+// and -E_TIMEOUT if the deadline passed.  The caller must then
+// sched_yield.
+//
+// Returns 0 if e is now blocked, < 0 on error.  Errors are:
+//	-E_INVAL if addr is not word-aligned or is above ULIM.
+//	-E_FAULT if addr is not mapped user-readable.
+//	-E_AGAIN if the word no longer holds val.
+//	-E_TIMEOUT if deadline has already passed.
+//	-E_NO_MEM if there is no memory for e's timeout.
+int
+futex_wait(struct Env *e, uint32_t *addr, uint32_t val, uint64_t deadline)
+{
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_key(e, addr, &pa)) < 0)
+		return r;
+	if (deadline && deadline <= time_nsec())
+		return -E_TIMEOUT;
+
+	// Checking the word under futex_lock means a waker that changes it
+	// and then calls futex_wake cannot slip in between.
+	spin_lock(&futex_lock);
+	if (*(volatile uint32_t *) KADDR(pa) != val) {
+		spin_unlock(&futex_lock);
+		return -E_AGAIN;
+	}
+	if (deadline && (r = sched_timeout(e, deadline, futex_expire)) < 0) {
+		spin_unlock(&futex_lock);
+		return r;
+	}
+	futex_enqueue(e, pa);
+	e->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	spin_unlock(&futex_lock);
+	return 0;
+}
+
+// Wake up to n of the envs waiting on the word at physical address pa,
+// oldest first.  Returns the number woken.
+static int
+futex_wake_pa(physaddr_t pa, int n)
+{
+	struct futex_chain *fc = &chains[FUTEX_HASH(pa)];
+	struct Env *e, *next;
+	int woken = 0;
+
+	spin_lock(&futex_lock);
+	for (e = fc->fc_head; e && woken < n; e = next) {
+		next = e->env_futex_next;
+		if (e->env_futex_pa != pa)
+			continue;
+		futex_dequeue(e);
+		e->env_tf.tf_regs.reg_eax = 0;
+		futex_resume(e);
+		woken++;
+	}
+	spin_unlock(&futex_lock);
+	return woken;
+}
+
+// Wake up to n of the envs waiting on the word at addr in e's address
+// space.  Returns the number woken, or < 0 on the errors of futex_wait.
+int
+futex_wake(struct Env *e, uint32_t *addr, int n)
+{
+	physaddr_t pa;
+	int r;
+
+	if ((r = futex_key(e, addr, &pa)) < 0)
+		return r;
+	return futex_wake_pa(pa, n);
+}
+
+// Take e off whatever futex it is waiting on, because it is going away.
+void
+futex_cancel(struct Env *e)
+{
+	spin_lock(&futex_lock);
+	if (e->env_futex_pa) {
+		futex_dequeue(e);
+		sched_timeout_cancel(e);
+	}
+	spin_unlock(&futex_lock);
+}
@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+int futex_wait(struct Env *e, uint32_t *addr, uint32_t val, uint64_t deadline);
+int futex_wake(struct Env *e, uint32_t *addr, int n);
+void futex_cancel(struct Env *e);
+
+#endif /* !JOS_KERN_FUTEX_H */
@@ -7,14 +7,17 @@
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/slab.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
+#include <kern/ipc.h>
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/timer.h>
 #include <kern/pci.h>
 
 static void boot_aps(void);
@@ -35,7 +38,7 @@ void spinlock_test()
 	for (i=0; i<100; i++) {
 		lock_kernel();
 		if (test_ctr % 10000 != 0)
-			panic("ticket spinlock test fail: I saw a middle value\n");
+			panic("spinlock test fail: I saw a middle value\n");
 		interval = 0;
 		while (interval++ < 10000)
 			test_ctr++;
@@ -64,6 +67,9 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	mem_init();
+	slab_init();
+	sched_init();
+	ipc_init();
 
 	// Lab 3 user environment initialization functions
 	env_init();
@@ -78,6 +84,8 @@ i386_init(void)
 
 	// Lab 6 hardware initialization functions
 	time_init();
+	timer_init();
+	sched_slice_start();
 	pci_init();
 
 	// Acquire the big kernel lock before waking up APs
@@ -86,13 +94,15 @@ i386_init(void)
 	// Starting non-boot CPUs
 	boot_aps();
 
-#ifdef USE_TICKET_SPIN_LOCK
+#if defined(USE_TICKET_SPIN_LOCK) || defined(USE_MCS_SPIN_LOCK)
 	unlock_kernel();
 	spinlock_test();
 	lock_kernel();
 #endif
 
-	// Should always have idle processes at first.
+	// Should always have idle processes at first.  The scheduler
+	// halts idle CPUs instead of running these, but they keep the
+	// env IDs of everything after them stable.
 	int i;
 	for (i = 0; i < NCPU; i++)
 		ENV_CREATE(user_idle, ENV_TYPE_IDLE);
@@ -163,9 +173,10 @@ mp_main(void)
 	lapic_init();
 	env_init_percpu();
 	trap_init_percpu();
+	sched_slice_start();
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
-#ifdef USE_TICKET_SPIN_LOCK
+#if defined(USE_TICKET_SPIN_LOCK) || defined(USE_MCS_SPIN_LOCK)
 	spinlock_test();
 #endif
 
@@ -0,0 +1,410 @@
+// IPC between envs: handing a value, and maybe a page, to an env
+// blocked in sys_ipc_recv or waiting for the reply to a sys_ipc_call,
+// the bounded queue of messages sys_ipc_try_send leaves for each env
+// that isn't receiving, and the queues of senders blocked in
+// sys_ipc_send or sys_ipc_call until their receiver gets round to them.
+//
+// Everything here runs under the big kernel lock, including the send
+// timeouts, which fire from trap().
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <inc/string.h>
+
+#include <kern/ipc.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/slab.h>
+
+// Whether dst is waiting for a message that src may send: dst is in
+// sys_ipc_recv, or in sys_ipc_call and src is the env it called.
+bool
+ipc_recving(struct Env *dst, struct Env *src)
+{
+	return dst->env_ipc_recving
+		&& (!dst->env_ipc_recv_from || dst->env_ipc_recv_from == src->env_id);
+}
+
+// A message that sys_ipc_try_send queued for an env that wasn't
+// receiving, holding a reference to the page sent with it, if any.
+struct ipc_msg {
+	envid_t m_from;
+	uint32_t m_value;
+	struct Page *m_page;
+	unsigned m_perm;
+};
+
+// An env's queued messages, a ring indexed by freely running q_head
+// and q_tail.  It comes from queue_cache when a message is first queued
+// for the env, and stays with the env until the env is freed.
+struct ipc_queue {
+	struct ipc_msg q_msgs[IPC_QUEUE_LEN];
+	uint32_t q_head;
+	uint32_t q_tail;
+};
+
+static struct kmem_cache *queue_cache;
+
+void
+ipc_init(void)
+{
+	queue_cache = kmem_cache_create("ipc_queue", sizeof(struct ipc_queue),
+					NULL);
+}
+
+// Find the page at srcva in src to be sent with permissions *perm,
+// checking them as sys_ipc_try_send describes, and complete *perm,
+// less any IPC_MOVE flag.  *ppp is set to NULL if srcva >= UTOP,
+// meaning no page is sent.
+//
+// Returns 0 on success, < 0 on the page errors of sys_ipc_try_send.
+static int
+ipc_page(struct Env *src, void *srcva, unsigned *perm, struct Page **ppp)
+{
+	pte_t *pte = NULL;
+	struct Page *pp;
+	uint32_t va = (uint32_t)srcva;
+
+	*ppp = NULL;
+	*perm &= ~IPC_MOVE;
+	if (va >= UTOP) {
+		return 0;
+	}
+	if (va % PGSIZE) {
+		return -E_INVAL;
+	}
+	*perm |= PTE_U | PTE_P;
+	if (*perm & ~PTE_SYSCALL) {
+		return -E_INVAL;
+	}
+	pp = page_lookup(src->env_pgdir, srcva, &pte);
+	if (pp == NULL) {
+		return -E_INVAL;
+	}
+	if ((*perm & PTE_W) && (*pte & PTE_W) == 0) {
+		return -E_INVAL;
+	}
+	if (*pte & PTE_PS) {
+		// a superpage can only be sent whole
+		if (va % PTSIZE) {
+			return -E_INVAL;
+		}
+		*perm |= PTE_PS;
+	}
+	*ppp = pp;
+	return 0;
+}
+
+// Map page pp, if not NULL, at dst's env_ipc_dstva with perm, if dst
+// asked for a page, and set dst's env_ipc_perm accordingly.
+static int
+ipc_map(struct Env *dst, struct Page *pp, unsigned perm)
+{
+	int r;
+	uint32_t dstva = (uint32_t)dst->env_ipc_dstva;
+
+	dst->env_ipc_perm = 0;
+	if (pp == NULL || dstva >= UTOP) {
+		return 0;
+	}
+	if ((perm & PTE_PS) && dstva % PTSIZE) {
+		return -E_INVAL;
+	}
+	r = page_insert(dst->env_pgdir, pp, dst->env_ipc_dstva, perm);
+	if (r < 0) {
+		return r;
+	}
+	dst->env_ipc_perm = perm;
+	return 0;
+}
+
+// Fill in the rest of dst's ipc fields for a message from 'from',
+// its page, if any, already mapped by ipc_map.
+static void
+ipc_finish(struct Env *dst, envid_t from, uint32_t value,
+	   const uint32_t *words, int nwords)
+{
+	memmove(dst->env_ipc_words, words, nwords * sizeof(uint32_t));
+	dst->env_ipc_nwords = nwords;
+	dst->env_ipc_value = value;
+	dst->env_ipc_from = from;
+	dst->env_ipc_recving = 0;
+	dst->env_tf.tf_regs.reg_eax = dst->env_ipc_recv_from ? value : 0;
+}
+
+// Hand value, and either nwords message words or the page at srcva in
+// src if srcva < UTOP, to dst, for which ipc_recving(dst, src) holds.
+// dst's ipc fields are updated as described for sys_ipc_try_send, and
+// its syscall will return 0, or the value itself for a sys_ipc_call;
+// making it runnable again is up to the caller.  If perm has IPC_MOVE,
+// the page is unmapped from src once the message is delivered.
+//
+// Returns 0 on success, < 0 on the page errors of sys_ipc_try_send.
+int
+ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm, const uint32_t *words, int nwords)
+{
+	int r;
+	bool move = (perm & IPC_MOVE) != 0;
+	struct Page *pp = NULL;
+
+	if (nwords == 0) {
+		r = ipc_page(src, srcva, &perm, &pp);
+		if (r < 0) {
+			return r;
+		}
+	}
+	r = ipc_map(dst, pp, perm);
+	if (r < 0) {
+		return r;
+	}
+	if (pp && move) {
+		page_remove(src->env_pgdir, srcva);
+	}
+	ipc_finish(dst, src->env_id, value, words, nwords);
+	return 0;
+}
+
+// Queue value, and the page at srcva in src if srcva < UTOP, for dst,
+// which isn't receiving from src, to pick up when it next receives.
+// With IPC_MOVE, the page is unmapped from src right away.
+//
+// Returns 0 on success, -E_IPC_NOT_RECV if dst's queue is full, -E_NO_MEM
+// if dst has no queue yet and there is no memory for one, or < 0 on the
+// page errors of sys_ipc_try_send.
+int
+ipc_enqueue(struct Env *src, struct Env *dst, uint32_t value,
+	    void *srcva, unsigned perm)
+{
+	struct ipc_queue *q = dst->env_ipc_queue;
+	struct ipc_msg *m;
+	struct Page *pp;
+	bool move = (perm & IPC_MOVE) != 0;
+	int r;
+
+	if (q && q->q_tail - q->q_head == IPC_QUEUE_LEN) {
+		return -E_IPC_NOT_RECV;
+	}
+	r = ipc_page(src, srcva, &perm, &pp);
+	if (r < 0) {
+		return r;
+	}
+	if (q == NULL) {
+		q = kmem_cache_alloc(queue_cache);
+		if (q == NULL) {
+			return -E_NO_MEM;
+		}
+		q->q_head = q->q_tail = 0;
+		dst->env_ipc_queue = q;
+	}
+	m = &q->q_msgs[q->q_tail++ % IPC_QUEUE_LEN];
+	m->m_from = src->env_id;
+	m->m_value = value;
+	m->m_page = pp;
+	m->m_perm = perm;
+	if (pp) {
+		pp->pp_ref++;
+		if (move) {
+			page_remove(src->env_pgdir, srcva);
+		}
+	}
+	return 0;
+}
+
+// Deliver to dst the oldest message queued for it by ipc_enqueue that
+// it is waiting for.  A page that can't be mapped is dropped, as its
+// sender is long gone.
+//
+// Returns 1 if a message was delivered, 0 if none was queued.
+static bool
+ipc_recv_enqueued(struct Env *dst)
+{
+	struct ipc_queue *q = dst->env_ipc_queue;
+	struct ipc_msg m;
+	uint32_t i;
+
+	if (q == NULL) {
+		return 0;
+	}
+	for (i = q->q_head; i != q->q_tail; i++) {
+		m = q->q_msgs[i % IPC_QUEUE_LEN];
+		if (!dst->env_ipc_recv_from || dst->env_ipc_recv_from == m.m_from) {
+			break;
+		}
+	}
+	if (i == q->q_tail) {
+		return 0;
+	}
+	for (; i != q->q_head; i--) {
+		q->q_msgs[i % IPC_QUEUE_LEN] = q->q_msgs[(i - 1) % IPC_QUEUE_LEN];
+	}
+	q->q_head++;
+	if (ipc_map(dst, m.m_page, m.m_perm) < 0) {
+		dst->env_ipc_perm = 0;
+	}
+	if (m.m_page) {
+		page_decref(m.m_page);
+	}
+	ipc_finish(dst, m.m_from, m.m_value, NULL, 0);
+	return 1;
+}
+
+// Take blocked sender e off its receiver's queue.
+static void
+sendq_remove(struct Env *e)
+{
+	struct Env *dst = e->env_ipc_send_to;
+	struct Env **pp, *prev = NULL;
+
+	for (pp = &dst->env_ipc_sendq; *pp != e; pp = &(*pp)->env_ipc_send_next) {
+		prev = *pp;
+	}
+	*pp = e->env_ipc_send_next;
+	if (dst->env_ipc_sendq_tail == e) {
+		dst->env_ipc_sendq_tail = prev;
+	}
+	e->env_ipc_send_next = NULL;
+	e->env_ipc_send_to = NULL;
+}
+
+// Blocked sender e is off its receiver's queue, and its message was
+// delivered if r is 0 or failed with error r.  Finish its syscall.
+static void
+send_done(struct Env *e, int r)
+{
+	sched_timeout_cancel(e);
+	if (e->env_ipc_send_then == IPC_THEN_RECV) {
+		// A reply that can't be delivered is dropped
+		e->env_ipc_recving = 1;
+		if (ipc_recv_queued(e)) {
+			sched_wakeup(e);
+		}
+	} else if (r == 0 && e->env_ipc_send_then == IPC_THEN_REPLY) {
+		e->env_ipc_recving = 1;
+	} else {
+		e->env_tf.tf_regs.reg_eax = r;
+		sched_wakeup(e);
+	}
+}
+
+static void
+send_expire(struct Env *e)
+{
+	if (e->env_ipc_send_to) {
+		sendq_remove(e);
+		sched_wakeup(e);
+	}
+}
+
+// Block src until dst receives the message, or until time_nsec()
+// reaches deadline if it is nonzero.  Senders are served in the order
+// they blocked.  The caller must then sched_yield.
+//
+// Then, as 'then' says, src's sys_ipc_send returns the result of the
+// delivery, or -E_TIMEOUT; or src goes on waiting for dst's reply to
+// its sys_ipc_call; or src goes on to receive from anyone, for
+// sys_ipc_reply_wait, its reply delivered or not.
+//
+// Returns 0 if src is now blocked, or -E_NO_MEM if there is no memory
+// to set the deadline with.  Without a deadline it can't fail.
+int
+ipc_send_block(struct Env *src, struct Env *dst, uint32_t value,
+	       void *srcva, unsigned perm, const uint32_t *words, int nwords,
+	       uint64_t deadline, int then)
+{
+	int r;
+
+	if (deadline) {
+		r = sched_timeout(src, deadline, send_expire);
+		if (r < 0) {
+			return r;
+		}
+	}
+	src->env_ipc_send_then = then;
+	src->env_ipc_send_value = value;
+	src->env_ipc_send_srcva = srcva;
+	src->env_ipc_send_perm = perm;
+	src->env_ipc_send_nwords = nwords;
+	memmove(src->env_ipc_send_words, words, nwords * sizeof(uint32_t));
+	src->env_ipc_send_to = dst;
+	src->env_ipc_send_next = NULL;
+	if (dst->env_ipc_sendq_tail) {
+		dst->env_ipc_sendq_tail->env_ipc_send_next = src;
+	} else {
+		dst->env_ipc_sendq = src;
+	}
+	dst->env_ipc_sendq_tail = src;
+
+	src->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	sched_set_status(src, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// dst has just started receiving from anyone.  Deliver the oldest
+// message queued for it by sys_ipc_try_send, if any; otherwise that of
+// the first sender blocked on it that can be delivered, failing the
+// sends of those that can't, and let that sender carry on.
+//
+// Returns 1 if a message was delivered, 0 if dst must block.
+bool
+ipc_recv_queued(struct Env *dst)
+{
+	struct Env *src;
+	int r;
+
+	if (ipc_recv_enqueued(dst)) {
+		return 1;
+	}
+	while ((src = dst->env_ipc_sendq) != NULL) {
+		sendq_remove(src);
+		r = ipc_deliver(src, dst, src->env_ipc_send_value,
+				src->env_ipc_send_srcva, src->env_ipc_send_perm,
+				src->env_ipc_send_words, src->env_ipc_send_nwords);
+		send_done(src, r);
+		if (r == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// e is being freed: drop its queue and the messages on it, stop
+// waiting to send, and fail the sends of everyone waiting to send to e
+// and the calls of everyone waiting for e's reply.
+void
+ipc_env_free(struct Env *e)
+{
+	struct ipc_queue *q = e->env_ipc_queue;
+	struct Env *src;
+	int i;
+
+	if (q) {
+		for (; q->q_head != q->q_tail; q->q_head++) {
+			if (q->q_msgs[q->q_head % IPC_QUEUE_LEN].m_page) {
+				page_decref(q->q_msgs[q->q_head % IPC_QUEUE_LEN].m_page);
+			}
+		}
+		kmem_cache_free(queue_cache, q);
+		e->env_ipc_queue = NULL;
+	}
+
+	if (e->env_ipc_send_to) {
+		sendq_remove(e);
+		sched_timeout_cancel(e);
+	}
+	while ((src = e->env_ipc_sendq) != NULL) {
+		sendq_remove(src);
+		send_done(src, -E_BAD_ENV);
+	}
+	for (i = 0; i < NENV; i++) {
+		src = &envs[i];
+		if (src->env_status == ENV_NOT_RUNNABLE && src->env_ipc_recving
+		    && src->env_ipc_recv_from == e->env_id) {
+			src->env_ipc_recving = 0;
+			src->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+			sched_wakeup(src);
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef JOS_KERN_IPC_H
+#define JOS_KERN_IPC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+// What a sender blocked in ipc_send_block does once its message is
+// delivered
+#define IPC_THEN_RETURN	0	// Return from sys_ipc_send
+#define IPC_THEN_REPLY	1	// Wait for the reply, for sys_ipc_call
+#define IPC_THEN_RECV	2	// Receive from anyone, for sys_ipc_reply_wait
+
+// Messages sys_ipc_try_send can queue for an env that isn't receiving
+#define IPC_QUEUE_LEN	16
+
+bool ipc_recving(struct Env *dst, struct Env *src);
+int ipc_deliver(struct Env *src, struct Env *dst, uint32_t value,
+		void *srcva, unsigned perm, const uint32_t *words, int nwords);
+int ipc_enqueue(struct Env *src, struct Env *dst, uint32_t value,
+		void *srcva, unsigned perm);
+void ipc_init(void);
+int ipc_send_block(struct Env *src, struct Env *dst, uint32_t value,
+		   void *srcva, unsigned perm, const uint32_t *words,
+		   int nwords, uint64_t deadline, int then);
+bool ipc_recv_queued(struct Env *dst);
+void ipc_env_free(struct Env *e);
+
+#endif /* !JOS_KERN_IPC_H */
@@ -60,13 +60,11 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
-	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	// The timer counts down at bus frequency from lapic[TICR] and
+	// then issues an interrupt.  kern/timer.c runs it in one-shot
+	// mode for the next deadline, at the rate time_init calibrated
+	// against the PIT; leave it stopped until then.
+	lapic_timer_oneshot(0);
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -175,3 +173,44 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send interrupt 'vector' to the single CPU whose local APIC ID is apicid.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Start this CPU's timer counting down from its largest count, without
+// interrupting, so that time_init can measure its rate.
+void
+lapic_timer_free_run(void)
+{
+	if (!lapic)
+		return;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, MASKED | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0xFFFFFFFF);
+}
+
+// The current count of this CPU's timer.
+uint32_t
+lapic_timer_count(void)
+{
+	return lapic ? lapic[TCCR] : 0;
+}
+
+// Interrupt this CPU once, 'count' bus cycles from now.  A count of 0
+// stops the timer altogether.
+void
+lapic_timer_oneshot(uint32_t count)
+{
+	if (!lapic)
+		return;
+	lapicw(TDCR, X1);
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, count);
+}
@@ -13,6 +13,10 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/slab.h>
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -34,7 +38,13 @@ static struct Command commands[] = {
   { "chmapping", "Change the permission bits of a mapping", mon_chmapping },
   { "c", "Continue execution from the current location", mon_c },
   { "si", "Execute the code instruction by instruction", mon_si },
-  { "x", "Dispaly the memory", mon_x }
+  { "x", "Dispaly the memory", mon_x },
+  { "pagebench", "Time mixed-order page allocations and frees", mon_pagebench },
+  { "zeropool", "Display the pre-zeroed page pool counters", mon_zeropool },
+  { "coloring", "Turn per-environment page coloring on or off", mon_coloring },
+  { "slabinfo", "Display kernel object cache usage", mon_slabinfo },
+  { "cpuinfo", "Display per-CPU scheduling statistics", mon_cpuinfo },
+  { "lockstat", "Display spinlock contention statistics", mon_lockstat }
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -385,6 +395,139 @@ int mon_x(int argc, char **argv, struct Trapframe *tf)
         return 0;
 }
 
+// Microbenchmark for the page allocator: keep a window of live blocks
+// of mixed sizes and replace them in a scattered order, so that frees
+// have to coalesce and allocations have to split.
+#define PAGEBENCH_NBLK		64
+#define PAGEBENCH_ROUNDS	32
+
+int mon_pagebench(int argc, char **argv, struct Trapframe *tf)
+{
+        static const int sizes[] = { 1, 1, 2, 1, 4, 3, 8, 16 };
+        struct Page *blk[PAGEBENCH_NBLK];
+        int len[PAGEBENCH_NBLK];
+        int i, r, k, ops = 0;
+        unsigned long long start, end;
+
+        start = read_time_stamp_counter();
+        for (i = 0; i < 1000; ++i) {
+                struct Page *pp = page_alloc(0);
+                if (!pp) {
+                        cprintf("pagebench: out of memory\n");
+                        return 0;
+                }
+                page_free(pp);
+        }
+        end = read_time_stamp_counter();
+        cprintf("single page alloc+free: %u cycles\n", (uint32_t)(end - start) / 1000);
+
+        memset(blk, 0, sizeof(blk));
+        start = read_time_stamp_counter();
+        for (r = 0; r < PAGEBENCH_ROUNDS; ++r) {
+                for (i = 0; i < PAGEBENCH_NBLK; ++i) {
+                        k = (i * 37 + r * 11) % PAGEBENCH_NBLK;
+                        if (blk[k]) {
+                                page_free_npages(blk[k], len[k]);
+                                ++ops;
+                        }
+                        len[k] = sizes[(k + r) % (sizeof(sizes) / sizeof(sizes[0]))];
+                        blk[k] = page_alloc_npages(0, len[k]);
+                        ++ops;
+                }
+        }
+        for (k = 0; k < PAGEBENCH_NBLK; ++k) {
+                if (blk[k]) {
+                        page_free_npages(blk[k], len[k]);
+                        ++ops;
+                }
+        }
+        end = read_time_stamp_counter();
+        cprintf("mixed-order alloc/free: %d ops, %u cycles/op\n",
+                ops, (uint32_t)(end - start) / ops);
+        return 0;
+}
+
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf)
+{
+        cprintf("zero pool: %d pages, %u hits, %u misses\n",
+                zero_pool_npages, zero_pool_hits, zero_pool_misses);
+        return 0;
+}
+
+int mon_coloring(int argc, char **argv, struct Trapframe *tf)
+{
+        if (argc == 2 && strcmp(argv[1], "on") == 0) {
+                page_coloring = 1;
+        }
+        else if (argc == 2 && strcmp(argv[1], "off") == 0) {
+                page_coloring = 0;
+        }
+        else if (argc != 1) {
+                cprintf("Usage: [on | off]\n");
+                return 0;
+        }
+        cprintf("page coloring is %s (applies to new environments)\n",
+                page_coloring ? "on" : "off");
+        return 0;
+}
+
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf)
+{
+        struct kmem_cache *c;
+        int i, cached;
+        cprintf("%-16s %6s %6s %6s %8s %8s %10s\n", "cache", "size",
+                "perslab", "slabs", "active", "percpu", "allocs");
+        for (c = kmem_caches; c < kmem_caches + KMEM_NCACHE; c++) {
+                if (c->objsize == 0) {
+                        continue;
+                }
+                cached = 0;
+                for (i = 0; i < NCPU; i++) {
+                        cached += c->cpu[i].nobjs;
+                }
+                cprintf("%-16s %6u %6d %6u %8u %8d %10u\n", c->name,
+                        c->objsize, c->objs_per_slab, c->nslabs, c->nactive,
+                        cached, c->nallocs);
+        }
+        return 0;
+}
+
+int mon_cpuinfo(int argc, char **argv, struct Trapframe *tf)
+{
+        static const char *status[] = { "unused", "running", "halted" };
+        struct Cpu *c;
+        cprintf("%-4s %-8s %10s %6s %10s %10s\n", "cpu", "status", "env",
+                "queued", "ticks", "migrations");
+        for (c = cpus; c < cpus + ncpu; c++) {
+                cprintf("%-4d %-8s %10x %6d %10u %10u\n", c - cpus,
+                        status[c->cpu_status],
+                        c->cpu_env ? c->cpu_env->env_id : 0,
+                        c->cpu_rq_len, c->cpu_ticks, c->cpu_migrations);
+        }
+        return 0;
+}
+
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf)
+{
+#ifdef SPINLOCK_STATS
+        struct spinlock *lk;
+        cprintf("%-16s %10s %10s %12s %12s\n", "lock", "acquired",
+                "contended", "spins", "max hold");
+        for (lk = spinlock_stats; lk; lk = lk->stats_next) {
+#ifdef DEBUG_SPINLOCK
+                cprintf("%-16s ", lk->name);
+#else
+                cprintf("%16p ", lk);
+#endif
+                cprintf("%10u %10u %12llu %12llu\n", lk->nacquire,
+                        lk->ncontended, lk->nspin, lk->max_hold);
+        }
+#else
+        cprintf("Lock statistics are off; define SPINLOCK_STATS in kern/spinlock.h\n");
+#endif
+        return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -22,5 +22,11 @@ int mon_chmapping(int argc, char **argv, struct Trapframe *tf);
 int mon_c(int argc, char **argv, struct Trapframe *tf);
 int mon_si(int argc, char **argv, struct Trapframe *tf);
 int mon_x(int argc, char **argv, struct Trapframe *tf);
+int mon_pagebench(int argc, char **argv, struct Trapframe *tf);
+int mon_zeropool(int argc, char **argv, struct Trapframe *tf);
+int mon_coloring(int argc, char **argv, struct Trapframe *tf);
+int mon_slabinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_cpuinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_lockstat(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -11,6 +11,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 // page reserved as DMA
 #define DMA_PAGES 1024
@@ -22,10 +23,32 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
 struct Page *pages;		// Physical page state array
-static struct Page *page_free_list;	// Free list of physical pages
-static struct Page *chunk_list;
 
-#define PGCOLOR(la)		((((uintptr_t) (la)) >> PTXSHIFT) & 0x3)
+// Buddy allocator: free_area[k] lists the free blocks of 2^k contiguous,
+// 2^k-page aligned physical pages.  Each block is represented by its
+// first struct Page.  Blocks smaller than NPGCOLOR pages are further split
+// by the page color they cover, so that alloc_page_with_color never
+// has to search a list.
+#define BUDDY_MAX_ORDER		10
+#define PGCOLOR_ORDER		2	// log2(NPGCOLOR)
+static struct Page *free_area[BUDDY_MAX_ORDER + 1][NPGCOLOR];
+static size_t nfree_pages;	// Number of pages on all free lists
+
+// Protects the buddy free lists and the zero pool.  The per-CPU page
+// magazines belong to their CPU and need no lock of their own, except
+// against page_reclaim, which empties them all (see there).
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+
+// Number of free lists at a given order, and the one holding block pp
+#define BUDDY_NSLOT(order) \
+	((order) < PGCOLOR_ORDER ? NPGCOLOR >> (order) : 1)
+#define BUDDY_SLOT(pp, order) \
+	((order) < PGCOLOR_ORDER ? PGCOLOR(page2pa(pp)) >> (order) : 0)
+
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -75,9 +98,12 @@ static physaddr_t check_va2pa_large(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static int check_continuous(struct Page *pp, int num_page);
 static void check_n_pages(void);
+static void check_realloc_npages(void);
 static void check_page_installed_pgdir(void);
+static void page_init_high(void);
 void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void page_remove_pgtable(pde_t *pgdir, void *va);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -90,7 +116,7 @@ static void boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physa
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the page allocator has been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -162,6 +188,7 @@ mem_init(void)
 	// array.  'npages' is the number of physical pages in memory.
 	// Your code goes here:
   pages = (struct Page *)boot_alloc(npages * sizeof(struct Page));
+  memset(pages, 0, npages * sizeof(struct Page));
 
 	//////////////////////////////////////////////////////////////////////
 	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
@@ -179,8 +206,8 @@ mem_init(void)
 	check_page_alloc();
 	check_page_color();
 	check_page();
-	//check_n_pages();
-	//check_realloc_npages();
+	check_n_pages();
+	check_realloc_npages();
 
 	//////////////////////////////////////////////////////////////////////
 	// Now we set up virtual memory
@@ -202,6 +229,8 @@ mem_init(void)
 	// Permissions:
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
+	// The last page of the slot is left for the time page (see time.c).
+  static_assert(NENV * sizeof(struct Env) <= UTIME - UENVS);
   boot_map_region(kern_pgdir, UENVS,
                   ROUNDUP(NENV * sizeof(struct Env), PGSIZE),
                   PADDR(envs), PTE_U);
@@ -263,6 +292,10 @@ mem_init(void)
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
 
+	// All of physical memory is mapped now; hand the rest of it
+	// to the page allocator.
+	page_init_high();
+
 	check_page_free_list(0);
 
 	// entry.S set the really important flags in cr0 (including enabling
@@ -274,6 +307,10 @@ mem_init(void)
 
 	// Some more checks, only possible after kern_pgdir is installed.
 	check_page_installed_pgdir();
+
+	if (!(zero_page = page_alloc(ALLOC_ZERO)))
+		panic("mem_init: no memory for the zero page");
+	zero_page->pp_ref++;
 }
 
 // Modify mappings in kern_pgdir to support SMP
@@ -322,14 +359,161 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct Page' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are managed by a binary
+// buddy allocator: a free block of order k is 2^k pages aligned on a
+// 2^k page boundary and lives on free_area[k].  Allocation splits the
+// smallest large-enough block; freeing merges a block with its buddy
+// (the block whose page number differs only in bit k) for as long as
+// the buddy is free as well.  Both take O(BUDDY_MAX_ORDER) steps.
 // --------------------------------------------------------------
 
+static void
+buddy_push(struct Page *pp, int order)
+{
+        pp->pp_order = order;
+        pp->pp_flags |= PP_BUDDY_FREE;
+        struct Page **head = &free_area[order][BUDDY_SLOT(pp, order)];
+        pp->pp_link = *head;
+        if (pp->pp_link) {
+                pp->pp_link->pp_pprev = &pp->pp_link;
+        }
+        pp->pp_pprev = head;
+        *head = pp;
+}
+
+static void
+buddy_unlink(struct Page *pp)
+{
+        *pp->pp_pprev = pp->pp_link;
+        if (pp->pp_link) {
+                pp->pp_link->pp_pprev = pp->pp_pprev;
+        }
+        pp->pp_link = NULL;
+        pp->pp_pprev = NULL;
+        pp->pp_flags &= ~PP_BUDDY_FREE;
+}
+
+static inline bool
+buddy_is_free(size_t pfn, int order)
+{
+        return pfn < npages && (pages[pfn].pp_flags & PP_BUDDY_FREE)
+                && pages[pfn].pp_order == order;
+}
+
+// Take a block of 2^order pages off the free lists, splitting a larger
+// block if needed.  The unused upper halves go back on the free lists.
+static struct Page *
+buddy_alloc(int order)
+{
+        static unsigned next_slot;
+        struct Page *pp = NULL;
+        int o, i;
+        // Rotate through the colors, so uncolored allocations
+        // don't drain one color first.
+        next_slot++;
+        for (o = order; o <= BUDDY_MAX_ORDER && !pp; ++o) {
+                for (i = 0; i < BUDDY_NSLOT(o) && !pp; ++i) {
+                        pp = free_area[o][(next_slot + i) % BUDDY_NSLOT(o)];
+                }
+        }
+        if (!pp) {
+                return NULL;
+        }
+        o = pp->pp_order;
+        buddy_unlink(pp);
+        while (o > order) {
+                --o;
+                buddy_push(pp + (1 << o), o);
+        }
+        nfree_pages -= 1 << order;
+        return pp;
+}
+
+// Give back a block of 2^order pages, merging it with its buddy
+// for as long as the buddy is free.
+static void
+buddy_free(struct Page *pp, int order)
+{
+        size_t pfn = pp - pages;
+        nfree_pages += 1 << order;
+        while (order < BUDDY_MAX_ORDER && buddy_is_free(pfn ^ (1 << order), order)) {
+                buddy_unlink(&pages[pfn ^ (1 << order)]);
+                pfn &= ~(1 << order);
+                ++order;
+        }
+        buddy_push(&pages[pfn], order);
+}
+
+// Give back the n pages starting at page number pfn, as the largest
+// aligned blocks that fit.
+static void
+buddy_free_range(size_t pfn, size_t n)
+{
+        while (n > 0) {
+                int order = 0;
+                while (order < BUDDY_MAX_ORDER && !(pfn & (1 << order))
+                       && (2 << order) <= n) {
+                        ++order;
+                }
+                buddy_free(&pages[pfn], order);
+                pfn += 1 << order;
+                n -= 1 << order;
+        }
+}
+
+// Take the single page 'pfn' out of the free block that contains it,
+// splitting that block down around it.  Returns NULL if pfn is not free.
+static struct Page *
+buddy_carve(size_t pfn)
+{
+        struct Page *pp;
+        int o;
+        for (o = 0; o <= BUDDY_MAX_ORDER; ++o) {
+                if (buddy_is_free(pfn & ~((1 << o) - 1), o)) {
+                        break;
+                }
+        }
+        if (o > BUDDY_MAX_ORDER) {
+                return NULL;
+        }
+        pp = &pages[pfn & ~((1 << o) - 1)];
+        buddy_unlink(pp);
+        while (o > 0) {
+                --o;
+                if (pfn & (1 << o)) {
+                        buddy_push(pp, o);
+                        pp += 1 << o;
+                } else {
+                        buddy_push(pp + (1 << o), o);
+                }
+        }
+        nfree_pages--;
+        return pp;
+}
+
+// Hand the pages in [lo, hi) that are free at boot to the buddy allocator.
+static void
+page_init_range(size_t lo, size_t hi)
+{
+        size_t i;
+        // use boot_alloc(0) to get the begining of the free space
+        size_t cur_free = PADDR(boot_alloc(0)) / PGSIZE;
+        if (hi > npages - DMA_PAGES) {
+                hi = npages - DMA_PAGES;
+        }
+        for (i = lo; i < hi; i++) {
+                if ((i > 0 && i < npages_basemem && i != PGNUM(MPENTRY_PADDR)) || i >= cur_free) {
+                        pages[i].pp_ref = 0;
+                        buddy_free(&pages[i], 0);
+                }
+        }
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory via the buddy free lists.
 //
 void
 page_init(void)
@@ -355,17 +539,112 @@ page_init(void)
 	// Change the code to reflect this.
 	// NB: DO NOT actually touch the physical memory corresponding to
 	// free pages!
-	size_t i;
-  // use boot_alloc(0) to get the begining of the free space
-  size_t cur_free = PADDR(boot_alloc(0)) / PGSIZE;
-	for (i = 0; i < npages - DMA_PAGES; i++) {
-          if ((i > 0 && i < npages_basemem && i != PGNUM(MPENTRY_PADDR)) || i >= cur_free) {
-                  pages[i].pp_ref = 0;
-                  pages[i].pp_link = page_free_list;
-                  page_free_list = &pages[i];
-          }
-	}
-	chunk_list = NULL;
+
+  // entry_pgdir only maps the first 4MB of physical memory, so only
+  // those pages may be handed out until kern_pgdir is loaded.
+  // page_init_high() frees the rest.
+  page_init_range(0, PTSIZE / PGSIZE);
+}
+
+static void
+page_init_high(void)
+{
+  page_init_range(PTSIZE / PGSIZE, npages);
+}
+
+// Single pages are handed out from a per-CPU magazine in front of the
+// buddy allocator, so the common page_alloc/page_free pair only touches
+// thiscpu.  An empty magazine is refilled with PCP_BATCH pages; a full
+// one (PCP_HIGH pages) gives PCP_BATCH back to the buddy allocator.
+#define PCP_BATCH	16
+#define PCP_HIGH	(4 * PCP_BATCH)
+
+static void
+pcp_refill(struct Cpu *c)
+{
+        struct Page *pp;
+        while (c->cpu_npages < PCP_BATCH && (pp = buddy_alloc(0)) != NULL) {
+                pp->pp_link = c->cpu_pages;
+                c->cpu_pages = pp;
+                c->cpu_npages++;
+        }
+}
+
+static void
+pcp_drain(struct Cpu *c, int n)
+{
+        struct Page *pp;
+        while (n-- > 0 && (pp = c->cpu_pages) != NULL) {
+                c->cpu_pages = pp->pp_link;
+                c->cpu_npages--;
+                buddy_free(pp, 0);
+        }
+}
+
+// A page of zeros that is never freed, mapped read-only PTE_KCOW
+// wherever demand-zero memory is read before it is written.
+struct Page *zero_page;
+
+// Pages that are known to be zero already, so that page_alloc(ALLOC_ZERO)
+// can skip the memset.  Idle CPUs top the pool up with page_zero_refill();
+// it is only ever fed from the buddy allocator while memory is plentiful.
+#define ZERO_POOL_HIGH	256
+
+static struct Page *zero_pool;
+int zero_pool_npages;
+uint32_t zero_pool_hits, zero_pool_misses;
+
+void
+page_zero_refill(int n)
+{
+        struct Page *pp;
+        spin_lock(&page_lock);
+        while (n-- > 0 && zero_pool_npages < ZERO_POOL_HIGH
+               && nfree_pages > ZERO_POOL_HIGH && (pp = buddy_alloc(0)) != NULL) {
+                memset(page2kva(pp), 0, PGSIZE);
+                pp->pp_link = zero_pool;
+                zero_pool = pp;
+                zero_pool_npages++;
+        }
+        spin_unlock(&page_lock);
+}
+
+// Number of free pages, counting the ones parked in magazines
+// and in the zero pool.
+size_t
+page_nfree(void)
+{
+        size_t n = nfree_pages + zero_pool_npages;
+        int i;
+        for (i = 0; i < NCPU; ++i) {
+                n += cpus[i].cpu_npages;
+        }
+        return n;
+}
+
+// Give every magazine and the zero pool back to the buddy allocator, so
+// that the pages in them can merge again.  Used when the buddy allocator
+// runs dry; the caller holds page_lock.
+//
+// page_lock alone does not make it safe to empty another CPU's
+// magazine: page_alloc and page_free touch thiscpu's magazine without
+// it.  That relies on the big kernel lock, which every caller of the
+// page allocator holds once the other CPUs are up, so no other CPU can
+// be in the middle of using its magazine.  Without the big kernel lock
+// each CPU would have to empty its own magazine instead.
+static void
+page_reclaim(void)
+{
+        struct Page *pp;
+        int i;
+        for (i = 0; i < NCPU; ++i) {
+                pcp_drain(&cpus[i], cpus[i].cpu_npages);
+        }
+        while ((pp = zero_pool) != NULL) {
+                zero_pool = pp->pp_link;
+                zero_pool_npages--;
+                buddy_free(pp, 0);
+        }
 }
 
 //
@@ -380,23 +659,45 @@ page_init(void)
 struct Page *
 page_alloc(int alloc_flags)
 {
-        if (page_free_list) {
-                struct Page *res = page_free_list; // current free page list head pointer.
-                page_free_list = page_free_list->pp_link; // move to next free page
-                res->pp_link = NULL;
-
-                if (res->pp_ref) {
-                        panic("page_alloc: allocated a page in use\n");
+        struct Cpu *c = thiscpu;
+        struct Page *res = NULL;
+        if ((alloc_flags & ALLOC_ZERO) && zero_pool) {
+                spin_lock(&page_lock);
+                if ((res = zero_pool) != NULL) {
+                        zero_pool = res->pp_link;
+                        zero_pool_npages--;
+                        zero_pool_hits++;
+                        res->pp_link = NULL;
                 }
-
-                if (alloc_flags & ALLOC_ZERO) {
-                        memset(page2kva(res), 0, PGSIZE);
+                spin_unlock(&page_lock);
+                if (res) {
+                        return res;
                 }
-
-                return res;
-        } else {
+        }
+        if (!c->cpu_pages) {
+                spin_lock(&page_lock);
+                pcp_refill(c);
+                if (!c->cpu_pages) {
+                        page_reclaim();
+                        pcp_refill(c);
+                }
+                spin_unlock(&page_lock);
+        }
+        if (!(res = c->cpu_pages)) {
                 return NULL;
         }
+        c->cpu_pages = res->pp_link;
+        c->cpu_npages--;
+        if (res->pp_ref) {
+                panic("page_alloc: allocated a page in use\n");
+        }
+        res->pp_link = NULL;
+
+        if (alloc_flags & ALLOC_ZERO) {
+                zero_pool_misses++;
+                memset(page2kva(res), 0, PGSIZE);
+        }
+        return res;
 }
 
 //
@@ -406,86 +707,88 @@ page_alloc(int alloc_flags)
 // or via page_insert). 
 //
 // In order to figure out the n pages when return it. 
-// These n pages should be organized as a list.
+// These n pages should be organized as a list, in ascending address order.
 //
 // Returns NULL if out of free memory.
-// Returns NULL if n <= 0
+// Returns NULL if n <= 0 or n > 2^BUDDY_MAX_ORDER
 //
-// Try to reuse the pages cached in the chuck list
+// Takes a block of the next power of two and gives the tail back.
 //
 // Hint: use page2kva and memset
 struct Page *
 page_alloc_npages(int alloc_flags, int n)
 {
-        if (n <= 0) {
+        struct Page *res;
+        int i, order = 0;
+        if (n <= 0 || n > (1 << BUDDY_MAX_ORDER)) {
                 return NULL;
         }
-
-        struct Page head;
-        struct Page *cur = page_free_list;
-        head.pp_link = page_free_list;
-        int len = 0;
-        struct Page *begin = &head;
-        if (cur) {
-                len = 1;
-                while (cur->pp_link) {
-                        if (len >= n) { // find enough pages
-                                break;
-                        }
-                        if (page2pa(cur) - page2pa(cur->pp_link) == PGSIZE) { // only allocate n continuous pages
-                                ++len;
-                        }
-                        else {
-                                begin = cur;
-                                len = 1;
-                        }
-                        cur = cur->pp_link;
-                }
+        while ((1 << order) < n) {
+                ++order;
         }
 
-        if (len >= n) {
-                struct Page *res = NULL;
-                int i;
-                for (i = 0; i < n; ++i) {
-                        struct Page *p = begin->pp_link;
-                        if (p->pp_ref) {
-                                panic("page_alloc_npages: allocated a page in use\n");
-                        }
+        spin_lock(&page_lock);
+        if (!(res = buddy_alloc(order))) {
+                page_reclaim();
+                res = buddy_alloc(order);
+        }
+        if (res) {
+                buddy_free_range(res - pages + n, (1 << order) - n);
+        }
+        spin_unlock(&page_lock);
+        if (!res) {
+                return NULL;
+        }
 
-                        if (alloc_flags & ALLOC_ZERO) {
-                                memset(page2kva(p), 0, PGSIZE);
-                        }
-                        begin->pp_link = p->pp_link;
-                        p->pp_link = res;
-                        res = p;
+        for (i = 0; i < n; ++i) {
+                if (res[i].pp_ref) {
+                        panic("page_alloc_npages: allocated a page in use\n");
                 }
-                page_free_list = head.pp_link;
-                return res;
-        } else {
-                return NULL;
+                res[i].pp_link = (i + 1 < n) ? &res[i + 1] : NULL;
+        }
+        if (alloc_flags & ALLOC_ZERO) {
+                memset(page2kva(res), 0, n * PGSIZE);
         }
+        return res;
 }
 
-// Return n continuous pages to chunk list. Do the following things:
+// Return n continuous pages to the buddy allocator. Do the following things:
 //	1. Check whether the n pages int the list are continue, Return -1 on Error
-//	2. Add the pages to the chunk list
+//	2. Free them as the largest aligned blocks that fit
 //	
 //	Return 0 if everything ok
 int
 page_free_npages(struct Page *pp, int n)
 {
         struct Page *cur;
-        if(check_continuous(pp, n)) {
-                while(pp) {
-                        cur = pp;
-                        pp = pp->pp_link;
-                        page_free(cur);
+        int i;
+        if (!pp || n <= 0 || !check_continuous(pp, n)) {
+                return -1;
+        }
+        for (cur = pp, i = 0; i < n; cur = cur->pp_link, ++i) {
+                if (cur->pp_ref) {
+                        panic("page_free_npages: free a page in use!\n");
                 }
-                return 0;
         }
-        else {
-                return -1;
+        spin_lock(&page_lock);
+        buddy_free_range(pp - pages, n);
+        spin_unlock(&page_lock);
+        return 0;
+}
+
+// Take a page of the given color off the buddy free lists: the first
+// non-empty list that holds blocks covering that color has one.
+static struct Page *
+buddy_alloc_color(int color)
+{
+        struct Page *b;
+        int o;
+        for (o = 0; o <= BUDDY_MAX_ORDER; ++o) {
+                if ((b = free_area[o][o < PGCOLOR_ORDER ? color >> o : 0]) != NULL) {
+                        return buddy_carve(b - pages + (color & ((1 << MIN(o, PGCOLOR_ORDER)) - 1)));
+                }
         }
+        return NULL;
 }
 
 //
@@ -499,33 +802,76 @@ page_free_npages(struct Page *pp, int n)
 struct Page *
 alloc_page_with_color(int alloc_flags, int color)
 {
-        struct Page * last = NULL;
-        struct Page * cur = page_free_list;
-        while (cur != NULL && PGCOLOR(page2pa(cur)) != color) {
-                last = cur;
-                cur = cur->pp_link;
+        struct Page *res;
+        if (color < 0 || color >= NPGCOLOR) {
+                return NULL;
         }
-        if (cur) {
-                if (last) {
-                        last->pp_link = cur->pp_link;
-                }
-                else {
-                        page_free_list = cur->pp_link;
-                }
-                cur->pp_link = NULL;
-
-                if (cur->pp_ref) {
-                        panic("page_alloc: allocated a page in use\n");
-                }
+        spin_lock(&page_lock);
+        if (!(res = buddy_alloc_color(color))) {
+                page_reclaim();
+                res = buddy_alloc_color(color);
+        }
+        spin_unlock(&page_lock);
+        if (!res) {
+                return NULL;
+        }
+        if (res->pp_ref) {
+                panic("page_alloc: allocated a page in use\n");
+        }
+        res->pp_link = NULL;
 
-                if (alloc_flags & ALLOC_ZERO) {
-                        memset(page2kva(cur), 0, PGSIZE);
-                }
+        if (alloc_flags & ALLOC_ZERO) {
+                memset(page2kva(res), 0, PGSIZE);
+        }
+        return res;
+}
 
-                return cur;
-        } else {
+//
+// Allocates a 4MB superpage: PTSIZE bytes of physical memory aligned on
+// PTSIZE, which page_insert can map with a single PTE_PS directory entry.
+// The returned Page is the first of the 1024; its pp_ref counts the
+// superpage's mappings and page_free gives back the whole block.
+//
+// Returns NULL if out of free memory.
+//
+struct Page *
+page_alloc_large(int alloc_flags)
+{
+        struct Page *res;
+        static_assert((PGSIZE << BUDDY_MAX_ORDER) == PTSIZE);
+        spin_lock(&page_lock);
+        if (!(res = buddy_alloc(BUDDY_MAX_ORDER))) {
+                page_reclaim();
+                res = buddy_alloc(BUDDY_MAX_ORDER);
+        }
+        spin_unlock(&page_lock);
+        if (!res) {
                 return NULL;
         }
+        res->pp_link = NULL;
+        res->pp_flags |= PP_LARGE;
+        if (alloc_flags & ALLOC_ZERO) {
+                memset(page2kva(res), 0, PTSIZE);
+        }
+        return res;
+}
+
+int page_coloring;
+
+//
+// Allocates a physical page for env e's user memory.  If e has a page
+// color (see page_coloring), a page of that color is preferred; any page
+// will do once that color runs out.
+//
+struct Page *
+page_alloc_env(struct Env *e, int alloc_flags)
+{
+        struct Page *pp;
+        if (e && e->env_pgcolor >= 0
+            && (pp = alloc_page_with_color(alloc_flags, e->env_pgcolor)) != NULL) {
+                return pp;
+        }
+        return page_alloc(alloc_flags);
 }
 
 //
@@ -538,49 +884,52 @@ page_free(struct Page *pp)
         if (pp->pp_ref) {
                 panic("page_free: free a page in use!\n");
         }
-        struct Page head;
-        struct Page *cur = &head;
-        cur->pp_link = page_free_list; // physical address of nodes in this list is decreasing 
-        while (cur->pp_link && page2pa(cur->pp_link) > page2pa(pp)) { // add pp to page_free_list according to its PA 
-                cur = cur->pp_link;
+        if (pp->pp_flags & PP_BUDDY_FREE) {
+                panic("page_free: page is already free!\n");
+        }
+        if (pp->pp_flags & PP_LARGE) {
+                pp->pp_flags &= ~PP_LARGE;
+                spin_lock(&page_lock);
+                buddy_free(pp, BUDDY_MAX_ORDER);
+                spin_unlock(&page_lock);
+                return;
+        }
+        struct Cpu *c = thiscpu;
+        if (c->cpu_npages >= PCP_HIGH) {
+                spin_lock(&page_lock);
+                pcp_drain(c, PCP_BATCH);
+                spin_unlock(&page_lock);
         }
-        pp->pp_link = cur->pp_link;
-        cur->pp_link = pp;
-        page_free_list = head.pp_link;
+        pp->pp_link = c->cpu_pages;
+        c->cpu_pages = pp;
+        c->cpu_npages++;
 }
 
 struct Page *
 alloc_page_with_addr(physaddr_t addr)
 {
-        struct Page * last = NULL;
-        struct Page * cur = page_free_list;
-        while (cur != NULL && page2pa(cur) > addr) {
-                last = cur;
-                cur = cur->pp_link;
+        struct Page *res = NULL;
+        spin_lock(&page_lock);
+        if (PGNUM(addr) < npages) {
+                res = buddy_carve(PGNUM(addr));
         }
-        if (cur && page2pa(cur) == addr) {
-                if (last) {
-                        last->pp_link = cur->pp_link;
-                }
-                else {
-                        page_free_list = cur->pp_link;
-                }
-                cur->pp_link = NULL;
-
-                if (cur->pp_ref) {
-                        panic("page_alloc: allocated a page in use\n");
-                }
-                memset(page2kva(cur), 0, PGSIZE);
-                return cur;
-        } else {
+        spin_unlock(&page_lock);
+        if (!res) {
                 return NULL;
         }
+        if (res->pp_ref) {
+                panic("page_alloc: allocated a page in use\n");
+        }
+        res->pp_link = NULL;
+        memset(page2kva(res), 0, PGSIZE);
+        return res;
 }
 
 //
 // Return new_n continuous pages based on the allocated old_n pages.
 // You can man realloc for better understanding.
 // (Try to reuse the allocated pages as many as possible.)
+// Returns NULL, leaving the old pages alone, if out of memory.
 //
 struct Page *
 page_realloc_npages(struct Page *pp, int old_n, int new_n)
@@ -591,7 +940,7 @@ page_realloc_npages(struct Page *pp, int old_n, int new_n)
                 struct Page *cur = &head;
                 int i;
                 for (i = 0; i < new_n; ++i) {
-                        cur = cur->pp_link; // save these pages, extra pages will be collected to page_free_list
+                        cur = cur->pp_link; // save these pages, extra pages will be given back to the allocator
                 }
                 page_free_npages(cur->pp_link, old_n - new_n);
                 cur->pp_link = NULL;
@@ -601,9 +950,11 @@ page_realloc_npages(struct Page *pp, int old_n, int new_n)
                         return page_alloc_npages(ALLOC_ZERO, new_n);
                 }
                 struct Page *cur = pp;
+                struct Page *last;
                 while(cur->pp_link) {
                         cur = cur->pp_link;
                 }
+                last = cur;
                 int i;
                 for (i = old_n; i < new_n; ++i) {
                         struct Page *p;
@@ -618,6 +969,11 @@ page_realloc_npages(struct Page *pp, int old_n, int new_n)
                 }
                 if (i < new_n) { // can not allocate enough continuous pages at old page address. Free old pages and allocate new pages from scratch
                         struct Page *res = page_alloc_npages(ALLOC_ZERO, new_n);
+                        if (!res) {
+                                page_free_npages(last->pp_link, i - old_n);
+                                last->pp_link = NULL;
+                                return NULL;
+                        }
                         struct Page *new_p = res;
                         struct Page *old_p = pp;
                         int j;
@@ -626,11 +982,7 @@ page_realloc_npages(struct Page *pp, int old_n, int new_n)
                                 new_p = new_p->pp_link;
                                 old_p = old_p->pp_link;
                         }
-                        while (pp) {
-                                struct Page *p = pp;
-                                pp = pp->pp_link;
-                                page_free(p);
-                        }
+                        page_free_npages(pp, i);
                         pp = res;
                 }
                 return pp;
@@ -644,7 +996,8 @@ page_realloc_npages(struct Page *pp, int old_n, int new_n)
 void
 page_decref(struct Page* pp)
 {
-	if (--pp->pp_ref == 0)
+	// The zero page is mapped too often for its count to mean anything
+	if (--pp->pp_ref == 0 && pp != zero_page)
 		page_free(pp);
 }
 
@@ -652,6 +1005,9 @@ page_decref(struct Page* pp)
 // a pointer to the page table entry (PTE) for linear address 'va'.
 // This requires walking the two-level page table structure.
 //
+// If 'va' is covered by a 4MB superpage (PTE_PS), there is no page table
+// and pgdir_walk returns a pointer to the page directory entry itself.
+//
 // The relevant page table page might not exist yet.
 // If this is true, and create == false, then pgdir_walk returns NULL.
 // Otherwise, pgdir_walk allocates a new page table page with page_alloc.
@@ -765,6 +1121,10 @@ boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, in
 //   - pp->pp_ref should be incremented if the insertion succeeds.
 //   - The TLB must be invalidated if a page was formerly present at 'va'.
 //
+// If perm includes PTE_PS, pp must come from page_alloc_large and va must
+// be PTSIZE aligned; the whole 4MB is then mapped by one page directory
+// entry, replacing any mappings that were there.
+//
 // Corner-case hint: Make sure to consider what happens when the same
 // pp is re-inserted at the same virtual address in the same pgdir.
 // Don't be tempted to write special-case code to handle this
@@ -780,17 +1140,58 @@ boot_map_region_large(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, in
 int
 page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 {
-        pte_t *pte = pgdir_walk(pgdir, va, 1);
+        pde_t *pde = &pgdir[PDX(va)];
+        pte_t *pte;
+
+        pp->pp_ref++;
+        if (perm & PTE_PS) {
+                // a superpage replaces whatever maps its 4MB
+                assert((pp->pp_flags & PP_LARGE) && (uintptr_t) va % PTSIZE == 0);
+                if ((*pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS)) {
+                        page_remove(pgdir, va);
+                } else if (*pde & PTE_P) {
+                        page_remove_pgtable(pgdir, va);
+                }
+                *pde = page2pa(pp) | perm | PTE_P;
+                return 0;
+        }
+
+        // a 4KB page going into a superpage's range unmaps the superpage
+        if ((*pde & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS)) {
+                page_remove(pgdir, va);
+        }
+        pte = pgdir_walk(pgdir, va, 1);
         if (pte) {
-                pp->pp_ref++;
                 page_remove(pgdir, va);
                 *pte = page2pa(pp) | perm | PTE_P;
                 return 0;
         } else {
+                pp->pp_ref--;
                 return -E_NO_MEM;
         }
 }
 
+//
+// Unmap every page in the page table that covers 'va',
+// then free the page table itself.
+//
+static void
+page_remove_pgtable(pde_t *pgdir, void *va)
+{
+        physaddr_t pa = PTE_ADDR(pgdir[PDX(va)]);
+        pte_t *pt = KADDR(pa);
+        int i;
+        for (i = 0; i < NPTENTRIES; ++i) {
+                if (pt[i] & PTE_P) {
+                        page_decref(pa2page(PTE_ADDR(pt[i])));
+                        pt[i] = 0;
+                }
+        }
+        pgdir[PDX(va)] = 0;
+        page_decref(pa2page(pa));
+        tlb_flush(pgdir);
+}
+
 //
 // Return the page mapped at virtual address 'va'.
 // If pte_store is not zero, then we store in it the address
@@ -799,6 +1200,8 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 // but should not be used by most callers.
 //
 // Return NULL if there is no page mapped at va.
+// If va is covered by a superpage, this returns the superpage's first
+// Page and stores the page directory entry.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
 //
@@ -847,6 +1250,111 @@ page_remove(pde_t *pgdir, void *va)
         }
 }
 
+//
+// Copy the user part of address space 'src' into the empty 'dst' for
+// a copy-on-write fork, in one pass over src's page tables:
+//   - writable or copy-on-write pages become read-only PTE_KCOW in both,
+//     so that write faults on them are resolved by page_cow_fault;
+//   - PTE_SHARE and read-only pages are mapped into dst as they are;
+//   - the user exception stack is left out, the child needs its own;
+//   - writable superpages are copied eagerly, the rest are shared.
+// The caller must flush src's TLB afterwards.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table or superpage couldn't be allocated.
+//     dst is left partially filled in and should be freed by env_free.
+//
+int
+pgdir_fork_cow(pde_t *dst, pde_t *src)
+{
+        uint32_t pdeno, pteno;
+        pte_t *spt, *dpt;
+        struct Page *pp;
+
+        for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+                pde_t pde = src[pdeno];
+                if (!(pde & PTE_P)) {
+                        continue;
+                }
+                if (pde & PTE_PS) {
+                        pp = pa2page(PTE_ADDR(pde));
+                        if ((pde & PTE_W) && !(pde & PTE_SHARE)) {
+                                struct Page *np = page_alloc_large(0);
+                                if (!np) {
+                                        return -E_NO_MEM;
+                                }
+                                memmove(page2kva(np), page2kva(pp), PTSIZE);
+                                pp = np;
+                        }
+                        pp->pp_ref++;
+                        dst[pdeno] = page2pa(pp) | (pde & (PTE_SYSCALL | PTE_PS));
+                        continue;
+                }
+
+                pp = page_alloc(ALLOC_ZERO);
+                if (!pp) {
+                        return -E_NO_MEM;
+                }
+                pp->pp_ref++;
+                dst[pdeno] = page2pa(pp) | PTE_U | PTE_P | PTE_W;
+                dpt = page2kva(pp);
+                spt = KADDR(PTE_ADDR(pde));
+                for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+                        pte_t pte = spt[pteno];
+                        if (!(pte & PTE_P) ||
+                            (uintptr_t) PGADDR(pdeno, pteno, 0) == UXSTACKTOP - PGSIZE) {
+                                continue;
+                        }
+                        if ((pte & (PTE_W | PTE_COW | PTE_KCOW))
+                            && !(pte & PTE_SHARE)) {
+                                pte = (pte & ~(PTE_W | PTE_COW)) | PTE_KCOW;
+                                spt[pteno] = pte;
+                        }
+                        dpt[pteno] = PTE_ADDR(pte) | (pte & (PTE_SYSCALL | PTE_KCOW));
+                        pa2page(PTE_ADDR(pte))->pp_ref++;
+                }
+        }
+        return 0;
+}
+
+//
+// Flush the whole TLB, but only if the page tables being
+// edited are the ones currently in use by the processor.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (thiscpu->cpu_tlb_batch)
+			thiscpu->cpu_tlb_pending = 1;
+		else
+			lcr3(rcr3());
+	}
+}
+
+//
+// Defer TLB invalidations on this CPU until the matching
+// tlb_batch_end(), which does a single full flush if anything
+// mapped in the current address space changed in between.
+// Used to update a range of mappings for the price of one flush.
+//
+void
+tlb_batch_begin(void)
+{
+	thiscpu->cpu_tlb_batch++;
+}
+
+void
+tlb_batch_end(void)
+{
+	assert(thiscpu->cpu_tlb_batch > 0);
+	if (--thiscpu->cpu_tlb_batch == 0 && thiscpu->cpu_tlb_pending) {
+		thiscpu->cpu_tlb_pending = 0;
+		lcr3(rcr3());
+	}
+}
+
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
@@ -855,8 +1363,54 @@ void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
 	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
-		invlpg(va);
+	if (!curenv || curenv->env_pgdir == pgdir) {
+		if (thiscpu->cpu_tlb_batch)
+			thiscpu->cpu_tlb_pending = 1;
+		else
+			invlpg(va);
+	}
+}
+
+//
+// Resolve a write to the page at 'va' that the kernel mapped PTE_KCOW
+// in environment e: give e its own writable copy, or just make the
+// page writable again if nothing else maps it any more.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT if va isn't mapped PTE_KCOW
+//   -E_NO_MEM if there's no memory for the copy
+//
+int
+page_cow_fault(struct Env *e, uintptr_t va)
+{
+        void *pgva = (void *)ROUNDDOWN(va, PGSIZE);
+        struct Page *pp, *np;
+        pte_t *pte;
+        int perm, res;
+
+        pp = page_lookup(e->env_pgdir, pgva, &pte);
+        if (!pp || (*pte & PTE_PS) || !(*pte & PTE_KCOW)) {
+                return -E_FAULT;
+        }
+        perm = (*pte & PTE_SYSCALL) | PTE_W;
+        if (pp->pp_ref == 1 && pp != zero_page) {
+                *pte = page2pa(pp) | perm;
+                tlb_invalidate(e->env_pgdir, pgva);
+                return 0;
+        }
+        if (pp == zero_page) {
+                np = page_alloc_env(e, ALLOC_ZERO);
+        } else if ((np = page_alloc_env(e, 0)) != NULL) {
+                memmove(page2kva(np), page2kva(pp), PGSIZE);
+        }
+        if (!np) {
+                return -E_NO_MEM;
+        }
+        if ((res = page_insert(e->env_pgdir, np, pgva, perm)) < 0) {
+                page_free(np);
+        }
+        return res;
 }
 
 static uintptr_t user_mem_check_addr;
@@ -891,6 +1445,15 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
                         return -E_FAULT;
                 }
                 pte_t *pte = pgdir_walk(env->env_pgdir, (void *)(off + vaddr), 0);
+                // Fill in demand-zero and copy-on-write pages the
+                // kernel is about to touch, as a user access would
+                if ((!pte || !(*pte & PTE_P))
+                    && region_fault(env, off + vaddr, perm & PTE_W) == 0) {
+                        pte = pgdir_walk(env->env_pgdir, (void *)(off + vaddr), 0);
+                }
+                if (pte && (perm & PTE_W) && (*pte & PTE_KCOW)) {
+                        page_cow_fault(env, off + vaddr);
+                }
                 if (!pte || (*pte & perm) != perm) {
                         user_mem_check_addr = vaddr + off;
                         return -E_FAULT;
@@ -927,65 +1490,122 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // --------------------------------------------------------------
 
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the blocks on the buddy free lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct Page *pp;
+	struct Page *pp, *p;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int order, i, n;
+
+	if (!nfree_pages)
+		panic("the buddy free lists are empty!");
 
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct Page *pp1, *pp2;
-		struct Page **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
+	first_free_page = (char *) boot_alloc(0);
+	for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+	    for (n = 0; n < BUDDY_NSLOT(order); n++)
+		for (pp = free_area[order][n]; pp; pp = pp->pp_link) {
+			// check that we didn't corrupt the free lists themselves
+			assert(pp >= pages);
+			assert(pp + (1 << order) <= pages + npages);
+			assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+			assert((pp - pages) % (1 << order) == 0);
+			assert((pp->pp_flags & PP_BUDDY_FREE) && pp->pp_order == order);
+			assert(BUDDY_SLOT(pp, order) == n);
+			assert(*pp->pp_pprev == pp);
+			// free buddies should have been merged
+			assert(order == BUDDY_MAX_ORDER
+			       || !buddy_is_free((pp - pages) ^ (1 << order), order));
+
+			for (i = 0; i < (1 << order); i++) {
+				p = pp + i;
+				// page_init() must not hand out pages that
+				// entry_pgdir does not map
+				assert(PDX(page2pa(p)) < pdx_limit);
+
+				// if there's a page that shouldn't be on the
+				// free list, try to make sure it eventually
+				// causes trouble.
+				memset(page2kva(p), 0x97, 128);
+
+				// check a few pages that shouldn't be on the free list
+				assert(page2pa(p) != 0);
+				assert(page2pa(p) != IOPHYSMEM);
+				assert(page2pa(p) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(p) != EXTPHYSMEM);
+				assert(page2pa(p) < EXTPHYSMEM || (char *) page2kva(p) >= first_free_page);
+				// (new test for lab 4)
+				assert(page2pa(p) != MPENTRY_PADDR);
+
+				if (page2pa(p) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
 		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
 
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link){
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	// pages parked in the per-CPU magazines
+	for (i = 0; i < NCPU; i++) {
+		n = 0;
+		for (p = cpus[i].cpu_pages; p; p = p->pp_link) {
+			assert(p >= pages && p < pages + npages);
+			assert(!(p->pp_flags & PP_BUDDY_FREE) && p->pp_ref == 0);
+			assert(PDX(page2pa(p)) < pdx_limit);
+			memset(page2kva(p), 0x97, 128);
+			if (page2pa(p) < EXTPHYSMEM)
+				++nfree_basemem;
+			else
+				++nfree_extmem;
+			n++;
+		}
+		assert(n == cpus[i].cpu_npages);
 	}
 
-	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
+	// pages in the zero pool (which must stay zero)
+	for (p = zero_pool, n = 0; p; p = p->pp_link, n++) {
+		assert(p >= pages && p < pages + npages);
+		assert(!(p->pp_flags & PP_BUDDY_FREE) && p->pp_ref == 0);
+		if (page2pa(p) < EXTPHYSMEM)
 			++nfree_basemem;
 		else
 			++nfree_extmem;
 	}
+	assert(n == zero_pool_npages);
 
 	assert(nfree_basemem > 0);
 	assert(nfree_extmem > 0);
+	assert(nfree_basemem + nfree_extmem == page_nfree());
+}
+
+//
+// Take every free page out of the allocator, chained through pp_link,
+// so a check can run against an empty allocator.
+//
+static struct Page *
+check_steal_free_pages(void)
+{
+	struct Page *pp, *fl = NULL;
+
+	while ((pp = page_alloc(0)) != NULL) {
+		pp->pp_link = fl;
+		fl = pp;
+	}
+	return fl;
+}
+
+static void
+check_return_free_pages(struct Page *fl)
+{
+	struct Page *pp;
+
+	while (fl) {
+		pp = fl;
+		fl = fl->pp_link;
+		page_free(pp);
+	}
 }
 
 //
@@ -1005,8 +1625,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = page_nfree();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -1022,8 +1641,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1051,7 +1669,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -1059,9 +1677,7 @@ check_page_alloc(void)
 	page_free(pp2);
 
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(nfree == page_nfree());
 
 	cprintf("check_page_alloc() succeeded!\n");
 }
@@ -1227,8 +1843,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = check_steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1338,7 +1953,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -55,17 +55,50 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Software PTE bits whose meaning is fixed by the user library
+// (lib/fork.c and inc/lib.h); the in-kernel fork has to honour them.
+#define PTE_SHARE	0x400	// Shared with children, never copy-on-write
+#define PTE_COW		0x800	// Copy-on-write
+
+// Page color: which slice of a physically indexed cache a page maps to.
+#define NPGCOLOR		4
+#define PGCOLOR(la)		((((uintptr_t) (la)) >> PTXSHIFT) & (NPGCOLOR - 1))
+
+// When set, each new environment is given a page color round-robin and
+// page_alloc_env() prefers pages of that color.  Off by default.
+extern int page_coloring;
+
 void	mem_init(void);
 
 void	page_init(void);
 struct Page *page_alloc(int alloc_flags);
 void	page_free(struct Page *pp);
+struct Page *page_alloc_npages(int alloc_flags, int n);
+int	page_free_npages(struct Page *pp, int n);
+struct Page *page_realloc_npages(struct Page *pp, int old_n, int new_n);
+struct Page *alloc_page_with_color(int alloc_flags, int color);
+struct Page *alloc_page_with_addr(physaddr_t addr);
+struct Page *page_alloc_large(int alloc_flags);
+struct Page *page_alloc_env(struct Env *e, int alloc_flags);
+
+// Pool of pre-zeroed pages backing page_alloc(ALLOC_ZERO)
+extern int zero_pool_npages;
+extern uint32_t zero_pool_hits, zero_pool_misses;
+void	page_zero_refill(int n);
+size_t	page_nfree(void);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
 struct Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct Page *pp);
+int	pgdir_fork_cow(pde_t *dst, pde_t *src);
+int	page_cow_fault(struct Env *e, uintptr_t va);
+
+extern struct Page *zero_page;
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_batch_begin(void);
+void	tlb_batch_end(void);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
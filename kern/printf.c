@@ -5,6 +5,14 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Keeps lines printed by different CPUs from interleaving.
+static struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "cons_lock"
+#endif
+};
 
 static void
 putch(int ch, int *cnt)
@@ -16,9 +24,17 @@ putch(int ch, int *cnt)
 int
 vcprintf(const char *fmt, va_list ap)
 {
+	extern const char *panicstr;
 	int cnt = 0;
 
+	// A panicking CPU may be holding the lock already
+	if (panicstr) {
+		vprintfmt((void*)putch, &cnt, fmt, ap);
+		return cnt;
+	}
+	spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	spin_unlock(&cons_lock);
 	return cnt;
 }
 
@@ -1,64 +1,536 @@
 #include <inc/assert.h>
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/time.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
+#include <kern/slab.h>
+#include <kern/spinlock.h>
+#include <kern/timer.h>
+#include <kern/time.h>
 
+// Pages zeroed each time a CPU runs out of environments to run
+#define ZERO_REFILL_BATCH	8
+
+// Length of a time slice
+#define SCHED_SLICE_NSEC	(10 * NSEC_PER_MSEC)
+
+// Every SCHED_BOOST_TICKS time slices each CPU lifts the envs it has
+// queued back to their base priority, so that demoted CPU-bound envs
+// can't be starved forever by interactive ones.
+#define SCHED_BOOST_TICKS	100
+
+// Protects every CPU's run queues, nactive, ntimed, and the env_status,
+// env_level and env_affinity fields of the envs on them.
+static struct spinlock sched_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sched_lock"
+#endif
+};
+
+// Non-idle environments that are ENV_RUNNABLE or ENV_RUNNING, so that
+// sched_yield can tell in O(1) when there is nothing left to run.
+static int nactive;
+
+// Blocked envs with a timeout pending (see sched_timeout), which a timer
+// will wake even if no other env does.
+static int ntimed;
+
+// An env's timeout.  An env blocks on at most one thing at a time, be
+// it a sleep, a futex or a send, so one timeout per env is enough.  It
+// comes from timeout_cache the first time the env blocks with one, and
+// stays with the env until the env is freed.
+struct sched_timeout {
+	struct timer st_timer;
+	void (*st_expire)(struct Env *);
+};
+
+static struct kmem_cache *timeout_cache;
+
+// Each CPU's time-slice timer
+static struct timer slice_timers[NCPU];
+
+void
+sched_init(void)
+{
+	timeout_cache = kmem_cache_create("sched_timeout",
+					  sizeof(struct sched_timeout), NULL);
+}
+
+static bool
+env_active(unsigned status)
+{
+	return status == ENV_RUNNABLE || status == ENV_RUNNING;
+}
+
+// Append e to the tail of CPU c's run queue for e's current level.
+static void
+rq_insert(struct Env *e, int c)
+{
+	struct Cpu *cpu = &cpus[c];
+	int l = e->env_level;
+
+	e->env_rq_next = NULL;
+	e->env_rq_prev = cpu->cpu_rq_tail[l];
+	if (cpu->cpu_rq_tail[l])
+		cpu->cpu_rq_tail[l]->env_rq_next = e;
+	else
+		cpu->cpu_rq_head[l] = e;
+	cpu->cpu_rq_tail[l] = e;
+	cpu->cpu_rq_len++;
+	e->env_rq_cpu = c;
+}
+
+// Take e off whichever run queue holds it.
+static void
+rq_remove(struct Env *e)
+{
+	struct Cpu *cpu = &cpus[e->env_rq_cpu];
+	int l = e->env_level;
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		cpu->cpu_rq_head[l] = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		cpu->cpu_rq_tail[l] = e->env_rq_prev;
+	cpu->cpu_rq_len--;
+	e->env_rq_cpu = -1;
+}
+
+// Move e to MLFQ level l, requeueing it if it is queued.
+static void
+env_set_level(struct Env *e, int l)
+{
+	int c = e->env_rq_cpu;
+
+	if (c >= 0)
+		rq_remove(e);
+	e->env_level = l;
+	if (c >= 0)
+		rq_insert(e, c);
+}
+
+// Whether e's affinity mask lets it run on CPU c.
+static bool
+env_allowed(struct Env *e, int c)
+{
+	return (e->env_affinity >> c) & 1;
+}
+
+// The highest-priority env queued on cpu that may run on CPU c, or NULL.
+static struct Env *
+rq_first(struct Cpu *cpu, int c)
+{
+	struct Env *e;
+	int l;
+
+	for (l = 0; l < ENV_NPRIO; l++)
+		for (e = cpu->cpu_rq_head[l]; e; e = e->env_rq_next)
+			if (env_allowed(e, c))
+				return e;
+	return NULL;
+}
+
+// The CPU to queue a newly runnable env on: the preferred CPU c if e
+// may run there, otherwise the allowed CPU with the fewest queued envs.
+static int
+rq_place(struct Env *e, int c)
+{
+	int i;
+
+	if (env_allowed(e, c))
+		return c;
+	c = -1;
+	for (i = 0; i < ncpu; i++)
+		if (env_allowed(e, i)
+		    && (c < 0 || cpus[i].cpu_rq_len < cpus[c].cpu_rq_len))
+			c = i;
+	assert(c >= 0);
+	return c;
+}
+
+// Whether e, just queued, should take the CPU from cur, the env running
+// there: only if e is at a better MLFQ level.
+static bool
+env_preempts(struct Env *e, struct Env *cur)
+{
+	return cur && cur->env_status == ENV_RUNNING
+		&& cur->env_type != ENV_TYPE_IDLE
+		&& e->env_level < cur->env_level;
+}
+
+// e has just been queued on CPU c.  If c is halted, wake it with an
+// IPI; otherwise wake some other halted CPU that can steal e.  Failing
+// that, if e is at a better level than the env running on c, have c
+// reschedule right away rather than at the end of its time slice.
+static void
+sched_kick(struct Env *e, int c)
+{
+	int i;
+
+	if (cpus[c].cpu_status != CPU_HALTED)
+		for (i = 0; i < ncpu; i++)
+			if (cpus[i].cpu_status == CPU_HALTED && env_allowed(e, i)) {
+				c = i;
+				break;
+			}
+	if (cpus[c].cpu_status == CPU_HALTED)
+		lapic_ipi_cpu(cpus[c].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+	else if (env_preempts(e, cpus[c].cpu_env)) {
+		cpus[c].cpu_resched = 1;
+		if (c != cpunum())
+			lapic_ipi_cpu(cpus[c].cpu_id, IRQ_OFFSET + IRQ_WAKEUP);
+	}
+}
+
+// Stop e's timeout, if it has one pending.  The caller holds sched_lock.
+static void
+timeout_cancel(struct Env *e)
+{
+	struct sched_timeout *st = e->env_timeout;
+
+	if (st && st->st_timer.t_pending) {
+		timer_cancel(&st->st_timer);
+		ntimed--;
+	}
+}
+
+// Change e's status, keeping the run queues in step: a non-idle env is
+// on exactly one CPU's run queue while it is ENV_RUNNABLE.  Every
+// status change of an allocated env should go through here.
+//
+// An env that becomes runnable is queued on the CPU it last ran on, to
+// keep its cache and TLB warm, or on this CPU if it has never run, as
+// long as its affinity mask allows; idle CPUs steal from busy ones in
+// sched_yield, and halted ones are woken up.
+static void
+set_status(struct Env *e, unsigned status)
+{
+	int c;
+
+	// Anything but blocking again ends e's timeout
+	if (status != ENV_NOT_RUNNABLE)
+		timeout_cancel(e);
+
+	if (e->env_type != ENV_TYPE_IDLE) {
+		if (e->env_rq_cpu >= 0)
+			rq_remove(e);
+		if (status == ENV_RUNNABLE) {
+			c = e == curenv || e->env_runs == 0 ? cpunum() : e->env_cpunum;
+			c = rq_place(e, c);
+			rq_insert(e, c);
+			sched_kick(e, c);
+		}
+		nactive += env_active(status) - env_active(e->env_status);
+	}
+	e->env_status = status;
+}
+
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	spin_lock(&sched_lock);
+	set_status(e, status);
+	spin_unlock(&sched_lock);
+}
+
+// Set e's base priority.  Its MLFQ level starts over from there.
+void
+sched_set_priority(struct Env *e, int prio)
+{
+	spin_lock(&sched_lock);
+	e->env_prio = prio;
+	env_set_level(e, prio);
+	spin_unlock(&sched_lock);
+}
+
+// Restrict e to the CPUs in mask, which must include at least one CPU
+// that is up.  A queued env moves to an allowed CPU right away; one that
+// is running elsewhere moves the next time that CPU reschedules.
+int
+sched_set_affinity(struct Env *e, uint32_t mask)
+{
+	if (ncpu < 32)
+		mask &= (1 << ncpu) - 1;
+	if (mask == 0)
+		return -E_INVAL;
+	spin_lock(&sched_lock);
+	e->env_affinity = mask;
+	if (e->env_rq_cpu >= 0 && !env_allowed(e, e->env_rq_cpu))
+		set_status(e, ENV_RUNNABLE);
+	spin_unlock(&sched_lock);
+	return 0;
+}
+
+// Make e, blocked in an IPC receive or on a futex, runnable again.
+// Envs that block rather than use up their time slices get back their
+// full priority.
+void
+sched_wakeup(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	e->env_level = e->env_prio;
+	set_status(e, ENV_RUNNABLE);
+	spin_unlock(&sched_lock);
+}
+
+// Run e, blocked in an IPC receive, on this CPU right away, in place
+// of curenv, which has just blocked: e gets the rest of curenv's time
+// slice and skips the run queues.  If e may not run here, it is queued
+// where it may instead.
+void
+sched_switch(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	e->env_level = e->env_prio;
+	if (!env_allowed(e, cpunum())) {
+		set_status(e, ENV_RUNNABLE);
+		spin_unlock(&sched_lock);
+		sched_yield();
+	}
+	set_status(e, ENV_RUNNING);
+	spin_unlock(&sched_lock);
+	env_run(e);
+}
+
+static void
+timeout_expire(struct timer *t)
+{
+	struct Env *e = t->t_arg;
+
+	spin_lock(&sched_lock);
+	ntimed--;
+	spin_unlock(&sched_lock);
+	e->env_timeout->st_expire(e);
+}
+
+// Call expire(e) once time_nsec() reaches deadline, unless e's timeout
+// is cancelled first, which happens whenever e stops being
+// ENV_NOT_RUNNABLE.  A blocking syscall sets the timeout just before
+// blocking e; expire is to undo whatever e is blocked on and wake it.
+//
+// Timeouts rely on the big kernel lock, which keeps a timeout from
+// going off while it is being set, cancelled or freed.
+//
+// Returns 0 on success, -E_NO_MEM if e has no timeout yet and there is
+// no memory for one.
+int
+sched_timeout(struct Env *e, uint64_t deadline, void (*expire)(struct Env *))
+{
+	struct sched_timeout *st = e->env_timeout;
+
+	if (st == NULL) {
+		if ((st = kmem_cache_alloc(timeout_cache)) == NULL)
+			return -E_NO_MEM;
+		st->st_timer.t_pending = 0;
+		e->env_timeout = st;
+	}
+
+	spin_lock(&sched_lock);
+	if (!st->st_timer.t_pending)
+		ntimed++;
+	st->st_expire = expire;
+	timer_set(&st->st_timer, deadline, timeout_expire, e);
+	spin_unlock(&sched_lock);
+	return 0;
+}
+
+// Stop e's timeout early, for an env that stays blocked.
+void
+sched_timeout_cancel(struct Env *e)
+{
+	spin_lock(&sched_lock);
+	timeout_cancel(e);
+	spin_unlock(&sched_lock);
+}
+
+// e is being freed: give its timeout back to timeout_cache.
+void
+sched_timeout_free(struct Env *e)
+{
+	if (e->env_timeout == NULL)
+		return;
+	sched_timeout_cancel(e);
+	kmem_cache_free(timeout_cache, e->env_timeout);
+	e->env_timeout = NULL;
+}
+
+// Block e until time_nsec() reaches deadline.  Returns 0 on success,
+// -E_NO_MEM if there is no memory for e's timeout.
+int
+sched_sleep(struct Env *e, uint64_t deadline)
+{
+	int r;
+
+	if ((r = sched_timeout(e, deadline, sched_wakeup)) < 0)
+		return r;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	return 0;
+}
+
+// Called at the end of every time slice.  The env that was running has
+// used its whole slice, so it drops a level; every SCHED_BOOST_TICKS all
+// the envs queued here go back to their base priority.
+static void
+sched_tick(void)
+{
+	struct Env *e, *next;
+	int l;
+
+	spin_lock(&sched_lock);
+	if (curenv && curenv->env_type != ENV_TYPE_IDLE
+	    && curenv->env_level < ENV_NPRIO - 1)
+		env_set_level(curenv, curenv->env_level + 1);
+
+	if (++thiscpu->cpu_ticks % SCHED_BOOST_TICKS == 0)
+		for (l = 1; l < ENV_NPRIO; l++)
+			for (e = thiscpu->cpu_rq_head[l]; e; e = next) {
+				next = e->env_rq_next;
+				if (e->env_prio < l)
+					env_set_level(e, e->env_prio);
+			}
+	spin_unlock(&sched_lock);
+}
+
+// A time slice is up: charge it to the running env and have trap()
+// reschedule.  Slices follow each other for as long as the CPU is busy.
+static void
+slice_expire(struct timer *t)
+{
+	timer_set(t, time_nsec() + SCHED_SLICE_NSEC, slice_expire, NULL);
+	sched_tick();
+	thiscpu->cpu_resched = 1;
+}
+
+// Start time-slicing this CPU, at boot and whenever it wakes from
+// sched_halt.
+void
+sched_slice_start(void)
+{
+	timer_set(&slice_timers[cpunum()], time_nsec() + SCHED_SLICE_NSEC,
+		  slice_expire, NULL);
+}
+
+// Pick a runnable env for this CPU: the highest-priority one on its own
+// run queues or, if those are empty, the first one allowed to run here
+// from the CPU with the most waiting envs.  The env is marked
+// ENV_RUNNING before sched_lock is dropped, so no other CPU can pick it
+// too.
+//
+// If preempt is set, curenv is being preempted rather than giving up
+// the CPU, and it keeps the CPU (NULL is returned) unless the env found
+// is at least at its level.
+static struct Env *
+sched_pick(bool preempt)
+{
+	struct Env *e, *victim = NULL;
+	int i, me = cpunum();
+
+	spin_lock(&sched_lock);
+	if (thiscpu->cpu_rq_len > 0)
+		victim = rq_first(thiscpu, me);
+	else
+		for (i = 0; i < ncpu; i++)
+			if (cpus[i].cpu_rq_len > 0
+			    && (!victim || cpus[i].cpu_rq_len > cpus[victim->env_rq_cpu].cpu_rq_len)
+			    && (e = rq_first(&cpus[i], me)) != NULL)
+				victim = e;
+	if (victim && preempt && curenv && curenv->env_status == ENV_RUNNING
+	    && curenv->env_type != ENV_TYPE_IDLE
+	    && curenv->env_level < victim->env_level)
+		victim = NULL;
+	if (victim)
+		set_status(victim, ENV_RUNNING);
+	spin_unlock(&sched_lock);
+	return victim;
+}
+
+// Halt this CPU until an interrupt brings it back into trap(): one of
+// the timers set on it, such as a sleeping env's, or a wakeup IPI from
+// sched_kick.  There are no time slices while halted, so an idle CPU
+// takes no interrupts at all until there is work for it.
+static void __attribute__((noreturn))
+sched_halt(void)
+{
+	// Whatever ran here last is blocked or gone; its page directory
+	// may be freed while we sleep.
+	curenv = NULL;
+	lcr3(PADDR(kern_pgdir));
+
+	// The kernel lock orders this against sched_kick, which must not
+	// see us still running after we have found nothing to pick.
+	timer_cancel(&slice_timers[cpunum()]);
+	xchg(&thiscpu->cpu_status, CPU_HALTED);
+	unlock_kernel();
+
+	// Reset the stack pointer, enable interrupts and halt.  A wakeup
+	// that raced with unlock_kernel is still pending, and sti holds
+	// it off for one instruction, so hlt cannot miss it.
+	asm volatile (
+		"movl $0, %%ebp\n"
+		"movl %0, %%esp\n"
+		"pushl $0\n"
+		"pushl $0\n"
+		"sti\n"
+		"1:\n"
+		"hlt\n"
+		"jmp 1b\n"
+	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	for (;;)
+		;
+}
 
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	struct Env *idle;
-	int i;
+	struct Env *e;
+	bool preempt = thiscpu->cpu_resched;
+
+	thiscpu->cpu_resched = 0;
 
-	// Implement simple round-robin scheduling.
-	//
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	//
-	// If no envs are runnable, but the environment previously
-	// running on this CPU is still ENV_RUNNING, it's okay to
-	// choose that environment.
-	//
-	// Never choose an environment that's currently running on
-	// another CPU (env_status == ENV_RUNNING) and never choose an
-	// idle environment (env_type == ENV_TYPE_IDLE).  If there are
-	// no runnable environments, simply drop through to the code
-	// below to switch to this CPU's idle environment.
-
-  if (curenv) {
-    int cureid = ENVX(curenv->env_id);
-    i = cureid + 1 == NENV ? 0 : cureid + 1;
-    while (i != cureid) {
-      if (envs[i].env_type != ENV_TYPE_IDLE && envs[i].env_status == ENV_RUNNABLE)
-        break;
-      i = i + 1 == NENV ? 0 : i + 1;
-    }
-    if (i != cureid || curenv->env_status == ENV_RUNNING) {
-      env_run(envs + i);
-    }
-  }
+	// If the env we were running may no longer run on this CPU, hand
+	// it over to one where it may.
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && !env_allowed(curenv, cpunum()))
+		sched_set_status(curenv, ENV_RUNNABLE);
+
+	// Round-robin within the highest non-empty level of this CPU's
+	// run queues (env_run puts the env we were running at the tail of
+	// its level), or steal an env from another CPU.  An env whose
+	// time slice ran out, or that a wakeup preempted, keeps running
+	// while nothing queued is at its level or better; one that gives
+	// up the CPU gives way to anything queued.  If nothing is queued
+	// anywhere but the env previously running on this CPU is still
+	// ENV_RUNNING, keep running it.  Idle environments are never
+	// queued or run.
+	if ((e = sched_pick(preempt)) != NULL)
+		env_run(e);
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && curenv->env_type != ENV_TYPE_IDLE)
+		env_run(curenv);
 
 	// For debugging and testing purposes, if there are no
-	// runnable environments other than the idle environments,
-	// drop into the kernel monitor.
-	for (i = 0; i < NENV; i++) {
-		if (envs[i].env_type != ENV_TYPE_IDLE &&
-		    (envs[i].env_status == ENV_RUNNABLE ||
-		     envs[i].env_status == ENV_RUNNING))
-			break;
-	}
-	if (i == NENV) {
+	// runnable environments other than the idle environments, and
+	// no blocked environment has a timeout that will wake it, none
+	// ever will be again, so drop into the kernel monitor.
+	if (nactive == 0 && ntimed == 0) {
 		cprintf("No more runnable environments!\n");
 		while (1)
 			monitor(NULL);
 	}
 
-	// Run this CPU's idle environment when nothing else is runnable.
-	idle = &envs[cpunum()];
-	if (!(idle->env_status == ENV_RUNNABLE || idle->env_status == ENV_RUNNING))
-		panic("CPU %d: No idle environment!", cpunum());
-	env_run(idle);
+	// Nothing else to do, so spend a little time zeroing pages for
+	// later page_alloc(ALLOC_ZERO) calls.
+	page_zero_refill(ZERO_REFILL_BATCH);
+
+	// Sleep until something is runnable again.
+	sched_halt();
 }
@@ -6,7 +6,21 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_set_status(struct Env *e, unsigned status);
+void sched_set_priority(struct Env *e, int prio);
+int sched_set_affinity(struct Env *e, uint32_t mask);
+void sched_wakeup(struct Env *e);
+void sched_switch(struct Env *e) __attribute__((noreturn));
+void sched_init(void);
+int sched_timeout(struct Env *e, uint64_t deadline,
+		  void (*expire)(struct Env *));
+void sched_timeout_cancel(struct Env *e);
+void sched_timeout_free(struct Env *e);
+int sched_sleep(struct Env *e, uint64_t deadline);
+void sched_slice_start(void);
 
 #endif	// !JOS_KERN_SCHED_H
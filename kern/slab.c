@@ -0,0 +1,250 @@
+#include <inc/stdio.h>
+#include <inc/assert.h>
+#include <inc/string.h>
+
+#include <kern/slab.h>
+#include <kern/pmap.h>
+
+// Every slab is one page.  The header sits at the start of the page,
+// followed by the free-list links (one index per object) and then the
+// objects themselves.  Free objects are linked through 'next' rather
+// than through their own memory so that constructed state survives a
+// trip through the cache.
+struct kmem_slab {
+	struct kmem_slab *next;
+	struct kmem_slab **pprev;
+	struct kmem_cache *cache;
+	uint16_t inuse;			// Objects not on the slab free list
+	uint16_t free;			// Index of the first free object
+	uint16_t link[];		// link[i] is the free object after i
+};
+
+#define SLAB_NONE	0xffff
+#define SLAB_ALIGN	sizeof(void *)
+
+struct kmem_cache kmem_caches[KMEM_NCACHE];
+
+static void check_kmem(void);
+
+void
+slab_init(void)
+{
+	check_kmem();
+}
+
+static void *
+slab_obj(struct kmem_cache *c, struct kmem_slab *s, int i)
+{
+	uintptr_t base = ROUNDUP((uintptr_t) &s->link[c->objs_per_slab], SLAB_ALIGN);
+	return (void *) (base + i * c->objsize);
+}
+
+static void
+slab_push(struct kmem_slab **list, struct kmem_slab *s)
+{
+	s->next = *list;
+	if (*list)
+		(*list)->pprev = &s->next;
+	s->pprev = list;
+	*list = s;
+}
+
+static void
+slab_unlink(struct kmem_slab *s)
+{
+	*s->pprev = s->next;
+	if (s->next)
+		s->next->pprev = s->pprev;
+}
+
+//
+// Create a cache of 'size'-byte objects.  ctor, if not NULL, is run once
+// on every object when the slab holding it is created.
+// Panics if there are already KMEM_NCACHE caches or the objects are
+// too big to fit in a slab.
+//
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, void (*ctor)(void *obj))
+{
+	struct kmem_cache *c;
+	size_t avail;
+
+	for (c = kmem_caches; c < kmem_caches + KMEM_NCACHE; c++)
+		if (c->objsize == 0)
+			break;
+	if (c == kmem_caches + KMEM_NCACHE)
+		panic("kmem_cache_create: too many caches for %s", name);
+
+	memset(c, 0, sizeof(*c));
+	strncpy(c->name, name, KMEM_NAMELEN - 1);
+	c->objsize = ROUNDUP(MAX(size, 1), SLAB_ALIGN);
+	c->ctor = ctor;
+	avail = PGSIZE - sizeof(struct kmem_slab) - SLAB_ALIGN;
+	c->objs_per_slab = MIN(avail / (c->objsize + sizeof(uint16_t)), SLAB_NONE);
+	if (c->objs_per_slab == 0)
+		panic("kmem_cache_create: %s objects of %u bytes don't fit a slab",
+		      name, size);
+	return c;
+}
+
+// Give the cache a new slab and make it the empty slab.
+static struct kmem_slab *
+slab_grow(struct kmem_cache *c)
+{
+	struct Page *pp;
+	struct kmem_slab *s;
+	int i;
+
+	if (!(pp = page_alloc(0)))
+		return NULL;
+	pp->pp_ref++;
+	s = page2kva(pp);
+	s->cache = c;
+	s->inuse = 0;
+	s->free = 0;
+	for (i = 0; i < c->objs_per_slab; i++) {
+		s->link[i] = (i + 1 < c->objs_per_slab) ? i + 1 : SLAB_NONE;
+		if (c->ctor)
+			c->ctor(slab_obj(c, s, i));
+	}
+	c->nslabs++;
+	slab_push(&c->empty, s);
+	return s;
+}
+
+// Take one object off the cache's slabs, growing the cache if needed.
+static void *
+slab_alloc(struct kmem_cache *c)
+{
+	struct kmem_slab *s;
+	void *obj;
+
+	if (!(s = c->partial) && !(s = c->empty) && !(s = slab_grow(c)))
+		return NULL;
+	obj = slab_obj(c, s, s->free);
+	s->free = s->link[s->free];
+	if (s->inuse++ == 0 || s->free == SLAB_NONE) {
+		slab_unlink(s);
+		slab_push(s->free == SLAB_NONE ? &c->full : &c->partial, s);
+	}
+	return obj;
+}
+
+// Put an object back on its slab.  Only one wholly free slab is kept;
+// any other goes back to the page allocator.
+static void
+slab_release(struct kmem_cache *c, void *obj)
+{
+	struct kmem_slab *s = ROUNDDOWN(obj, PGSIZE);
+	int i = ((uintptr_t) obj - (uintptr_t) slab_obj(c, s, 0)) / c->objsize;
+
+	assert(s->cache == c && obj == slab_obj(c, s, i));
+	s->link[i] = s->free;
+	s->free = i;
+	if (--s->inuse == 0) {
+		slab_unlink(s);
+		if (c->empty) {
+			c->nslabs--;
+			page_decref(pa2page(PADDR(s)));
+		} else
+			slab_push(&c->empty, s);
+	} else if (s->link[i] == SLAB_NONE) {
+		// it was full
+		slab_unlink(s);
+		slab_push(&c->partial, s);
+	}
+}
+
+//
+// Allocate an object from cache c.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+	int i = cpunum();
+	void *obj;
+
+	if (c->cpu[i].nobjs == 0) {
+		while (c->cpu[i].nobjs < KMEM_CPU_BATCH && (obj = slab_alloc(c)))
+			c->cpu[i].objs[c->cpu[i].nobjs++] = obj;
+		if (c->cpu[i].nobjs == 0)
+			return NULL;
+	}
+	c->nactive++;
+	c->nallocs++;
+	return c->cpu[i].objs[--c->cpu[i].nobjs];
+}
+
+//
+// Return an object to cache c.
+//
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+	int i = cpunum();
+
+	if (c->cpu[i].nobjs >= KMEM_CPU_HIGH)
+		while (c->cpu[i].nobjs > KMEM_CPU_HIGH - KMEM_CPU_BATCH)
+			slab_release(c, c->cpu[i].objs[--c->cpu[i].nobjs]);
+	c->cpu[i].objs[c->cpu[i].nobjs++] = obj;
+	c->nactive--;
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+struct kmem_check_obj {
+	uint32_t magic;
+	char pad[100];
+};
+
+static void
+kmem_check_ctor(void *obj)
+{
+	((struct kmem_check_obj *) obj)->magic = 0x5ab5ab;
+}
+
+static void
+check_kmem(void)
+{
+	struct kmem_cache *c;
+	struct kmem_check_obj *o, *objs[200];
+	int i, j, nfree;
+
+	nfree = page_nfree();
+	c = kmem_cache_create("check", sizeof(struct kmem_check_obj), kmem_check_ctor);
+	assert(c->objsize == sizeof(struct kmem_check_obj));
+	assert(c->objs_per_slab > 1);
+
+	// enough objects to need several slabs, all distinct and constructed
+	for (i = 0; i < 200; i++) {
+		assert((objs[i] = kmem_cache_alloc(c)) != NULL);
+		assert(objs[i]->magic == 0x5ab5ab);
+		for (j = 0; j < i; j++)
+			assert(objs[j] != objs[i]);
+	}
+	assert(c->nactive == 200 && c->nslabs >= 200 / c->objs_per_slab);
+
+	// freed objects come back first, still constructed
+	o = objs[17];
+	kmem_cache_free(c, o);
+	assert(kmem_cache_alloc(c) == o && o->magic == 0x5ab5ab);
+
+	// freeing everything hands all but one slab back
+	for (i = 0; i < 200; i++)
+		kmem_cache_free(c, objs[i]);
+	assert(c->nactive == 0);
+	for (i = 0; i < NCPU; i++)
+		while (c->cpu[i].nobjs > 0)
+			slab_release(c, c->cpu[i].objs[--c->cpu[i].nobjs]);
+	assert(c->nslabs == 1 && c->empty && !c->partial && !c->full);
+	c->nslabs--;
+	page_decref(pa2page(PADDR(c->empty)));
+	assert(page_nfree() == nfree);
+	memset(c, 0, sizeof(*c));
+
+	cprintf("check_kmem() succeeded!\n");
+}
@@ -0,0 +1,54 @@
+#ifndef JOS_KERN_SLAB_H
+#define JOS_KERN_SLAB_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/cpu.h>
+
+// Object caches for small, fixed-size kernel objects, carved out of
+// whole pages from page_alloc.  Each cache keeps a small per-CPU stack
+// of free objects in front of its slabs, like the page magazines in
+// pmap.c.  Objects are built by the cache's constructor when their slab
+// is created and must be handed back to kmem_cache_free in the same
+// constructed state.  The caches have no locks of their own; callers
+// hold the big kernel lock.
+
+#define KMEM_NAMELEN	16	// Longest cache name, including the NUL
+#define KMEM_NCACHE	16	// Most caches that can exist at once
+#define KMEM_CPU_BATCH	8	// Objects moved to or from a CPU at once
+#define KMEM_CPU_HIGH	(4 * KMEM_CPU_BATCH)
+
+struct kmem_slab;
+
+struct kmem_cache {
+	char name[KMEM_NAMELEN];
+	size_t objsize;			// Bytes per object, rounded up
+	int objs_per_slab;
+	void (*ctor)(void *obj);	// Constructor, or NULL
+
+	struct kmem_slab *partial;	// Slabs with some objects free
+	struct kmem_slab *full;		// Slabs with no objects free
+	struct kmem_slab *empty;	// At most one slab with all free
+
+	struct {
+		void *objs[KMEM_CPU_HIGH];
+		int nobjs;
+	} cpu[NCPU];
+
+	// Statistics for the 'slabinfo' monitor command
+	uint32_t nslabs;		// Pages held by the cache
+	uint32_t nactive;		// Objects handed out and not freed
+	uint32_t nallocs;		// Total kmem_cache_alloc calls
+};
+
+extern struct kmem_cache kmem_caches[KMEM_NCACHE];
+
+void	slab_init(void);
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *obj));
+void	*kmem_cache_alloc(struct kmem_cache *c);
+void	kmem_cache_free(struct kmem_cache *c, void *obj);
+
+#endif /* JOS_KERN_SLAB_H */
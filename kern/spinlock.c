@@ -16,6 +16,10 @@ struct spinlock kernel_lock = {
 #endif
 };
 
+#ifdef SPINLOCK_STATS
+struct spinlock *spinlock_stats;
+#endif
+
 // This is the atomic instruction that
 // reading the old value as well as doing the add operation.
 // If your gcc cannot support this function, please check your gcc version.
@@ -51,7 +55,9 @@ get_caller_pcs(uint32_t pcs[])
 static int
 holding(struct spinlock *lock)
 {
-#ifndef USE_TICKET_SPIN_LOCK
+#if defined(USE_MCS_SPIN_LOCK)
+	return lock->tail && lock->cpu == thiscpu;
+#elif !defined(USE_TICKET_SPIN_LOCK)
 	return lock->locked && lock->cpu == thiscpu;
 #else
 	return lock->cpu == thiscpu;
@@ -59,10 +65,29 @@ holding(struct spinlock *lock)
 }
 #endif
 
+#ifdef USE_MCS_SPIN_LOCK
+// Take one of this CPU's free MCS queue nodes.
+static struct mcs_node *
+mcs_node_get(void)
+{
+	struct mcs_node *n;
+
+	for (n = thiscpu->cpu_mcs; n < thiscpu->cpu_mcs + MCS_NNODE; n++)
+		if (!n->busy) {
+			n->busy = 1;
+			return n;
+		}
+	panic("CPU %d holds more than %d locks", cpunum(), MCS_NNODE);
+}
+#endif
+
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
-#ifndef USE_TICKET_SPIN_LOCK
+#if defined(USE_MCS_SPIN_LOCK)
+	lk->tail = NULL;
+	lk->node = NULL;
+#elif !defined(USE_TICKET_SPIN_LOCK)
 	lk->locked = 0;
 #else
   lk->own = 0;
@@ -73,6 +98,11 @@ __spin_initlock(struct spinlock *lk, char *name)
 	lk->name = name;
 	lk->cpu = 0;
 #endif
+
+#ifdef SPINLOCK_STATS
+	lk->nacquire = lk->ncontended = 0;
+	lk->nspin = lk->max_hold = 0;
+#endif
 }
 
 // Acquire the lock.
@@ -82,21 +112,58 @@ __spin_initlock(struct spinlock *lk, char *name)
 void
 spin_lock(struct spinlock *lk)
 {
+	uint32_t spins = 0;
+
 #ifdef DEBUG_SPINLOCK
 	if (holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
-#ifndef USE_TICKET_SPIN_LOCK
+#if defined(USE_MCS_SPIN_LOCK)
+	// Join the tail of the queue, then wait for the CPU ahead of us
+	// to hand the lock over by clearing our own node's flag.
+	struct mcs_node *n = mcs_node_get(), *prev;
+	n->next = NULL;
+	n->waiting = 1;
+	prev = (struct mcs_node *) xchg((volatile uint32_t *) &lk->tail, (uint32_t) n);
+	if (prev) {
+		prev->next = n;
+		while (n->waiting) {
+			asm volatile ("pause");
+			spins++;
+		}
+	}
+	lk->node = n;
+#elif !defined(USE_TICKET_SPIN_LOCK)
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	while (xchg(&lk->locked, 1) != 0) {
 		asm volatile ("pause");
+		spins++;
+	}
 #else
   unsigned ticket = atomic_return_and_add(&lk->next, 1);
-	while (atomic_return_and_add(&lk->own, 0) != ticket)
+	while (atomic_return_and_add(&lk->own, 0) != ticket) {
     asm volatile ("pause");
+		spins++;
+	}
+#endif
+
+#ifdef SPINLOCK_STATS
+	// The first acquisition puts the lock on spinlock_stats.  We hold
+	// the lock, but other CPUs may be adding theirs.
+	if (lk->nacquire++ == 0)
+		do
+			lk->stats_next = spinlock_stats;
+		while (!__sync_bool_compare_and_swap(&spinlock_stats, lk->stats_next, lk));
+	if (spins) {
+		lk->ncontended++;
+		lk->nspin += spins;
+	}
+	lk->hold_start = read_tsc();
+#else
+	(void) spins;
 #endif
 
 	// Record info about lock acquisition for debugging.
@@ -135,7 +202,29 @@ spin_unlock(struct spinlock *lk)
 	lk->cpu = 0;
 #endif
 
-#ifndef USE_TICKET_SPIN_LOCK
+#ifdef SPINLOCK_STATS
+	uint64_t held = read_tsc() - lk->hold_start;
+	if (held > lk->max_hold)
+		lk->max_hold = held;
+#endif
+
+#if defined(USE_MCS_SPIN_LOCK)
+	// Hand the lock to the next CPU in the queue.  If there seems to
+	// be none, try to empty the queue; if that fails, a CPU is joining
+	// and will link itself in behind us shortly.
+	struct mcs_node *n = lk->node;
+	lk->node = NULL;
+	if (!n->next) {
+		if (__sync_bool_compare_and_swap(&lk->tail, n, NULL)) {
+			n->busy = 0;
+			return;
+		}
+		while (!n->next)
+			asm volatile ("pause");
+	}
+	n->next->waiting = 0;
+	n->busy = 0;
+#elif !defined(USE_TICKET_SPIN_LOCK)
 	// The xchg serializes, so that reads before release are 
 	// not reordered after it.  The 1996 PentiumPro manual (Volume 3,
 	// 7.2) says reads can be carried out speculatively and in
@@ -9,12 +9,35 @@
 
 //#define USE_TICKET_SPIN_LOCK
 
+// Define USE_MCS_SPIN_LOCK instead to use MCS queue locks: each waiting
+// CPU spins on a queue node of its own rather than on the lock, so a
+// contended lock's cache line doesn't bounce between all the waiters.
+//#define USE_MCS_SPIN_LOCK
+
 // Comment this to disable spinlock debugging
 #define DEBUG_SPINLOCK
 
+// Uncomment this to count acquisitions, spins and hold times for each
+// lock, as shown by the 'lockstat' monitor command.
+//#define SPINLOCK_STATS
+
+#ifdef USE_MCS_SPIN_LOCK
+// A CPU's place in the queue of an MCS lock.  Each CPU has MCS_NNODE of
+// these (see struct Cpu), enough for the locks it can hold at once.
+#define MCS_NNODE	4
+struct mcs_node {
+	struct mcs_node *volatile next; // The CPU queued behind us
+	volatile unsigned waiting;      // Cleared when the lock is handed over
+	bool busy;                      // In use for some lock
+};
+#endif
+
 // Mutual exclusion lock.
 struct spinlock {
-#ifndef USE_TICKET_SPIN_LOCK
+#if defined(USE_MCS_SPIN_LOCK)
+	struct mcs_node *volatile tail; // Last CPU in the queue, or NULL
+	struct mcs_node *node;          // The holder's queue node
+#elif !defined(USE_TICKET_SPIN_LOCK)
 	unsigned locked;   // Is the lock held?
 #else
 	unsigned own;
@@ -28,8 +51,22 @@ struct spinlock {
 	uintptr_t pcs[10]; // The call stack (an array of program counters)
 	                   // that locked the lock.
 #endif
+
+#ifdef SPINLOCK_STATS
+	uint32_t nacquire;              // Times the lock was taken
+	uint32_t ncontended;            // ... of which we had to wait
+	uint64_t nspin;                 // Spin-loop iterations while waiting
+	uint64_t hold_start;            // TSC when the lock was last taken
+	uint64_t max_hold;              // Longest hold, in TSC cycles
+	struct spinlock *stats_next;    // Next lock on spinlock_stats
+#endif
 };
 
+#ifdef SPINLOCK_STATS
+// Every lock that has been taken at least once
+extern struct spinlock *spinlock_stats;
+#endif
+
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
@@ -4,6 +4,7 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/chan.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
@@ -14,6 +15,8 @@
 #include <kern/time.h>
 #include <kern/spinlock.h>
 #include <kern/e1000.h>
+#include <kern/futex.h>
+#include <kern/ipc.h>
 
 extern uint8_t e1000_mac[6];
 
@@ -103,12 +106,162 @@ sys_exofork(void)
   if (res < 0) {
     return res;
   }
-  e->env_status = ENV_NOT_RUNNABLE;
+  sched_set_status(e, ENV_NOT_RUNNABLE);
+  e->env_prio = e->env_level = curenv->env_prio;
+  e->env_affinity = curenv->env_affinity;
   e->env_tf = curenv->env_tf;
   e->env_tf.tf_regs.reg_eax = 0;
   return e->env_id;
 }
 
+// Fork the current environment in one system call: the child gets a
+// copy-on-write copy of everything below UTOP (see pgdir_fork_cow), a
+// fresh exception stack, the parent's page fault upcall, priority, heap
+// break and demand-zero regions, and is made runnable.  In the child,
+// sys_fork_cow appears to return 0.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM on memory exhaustion.
+static envid_t
+sys_fork_cow(void)
+{
+  struct Env *e = NULL;
+  struct Page *pp;
+  int res = env_alloc(&e, curenv->env_id);
+  if (res < 0) {
+    return res;
+  }
+  sched_set_status(e, ENV_NOT_RUNNABLE);
+  res = pgdir_fork_cow(e->env_pgdir, curenv->env_pgdir);
+  // Our writable pages are now read-only, even if the copy failed
+  tlb_flush(curenv->env_pgdir);
+  if (res < 0) {
+    env_free(e);
+    return res;
+  }
+  if (curenv->env_pgfault_upcall) {
+    pp = page_alloc_env(e, ALLOC_ZERO);
+    if (pp == NULL) {
+      env_free(e);
+      return -E_NO_MEM;
+    }
+    res = page_insert(e->env_pgdir, pp, (void *)(UXSTACKTOP - PGSIZE), PTE_P | PTE_U | PTE_W);
+    if (res < 0) {
+      page_free(pp);
+      env_free(e);
+      return res;
+    }
+  }
+  e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+  e->env_prio = e->env_level = curenv->env_prio;
+  e->env_affinity = curenv->env_affinity;
+  e->env_break = curenv->env_break;
+  memmove(e->env_anon, curenv->env_anon, sizeof(e->env_anon));
+  e->env_tf = curenv->env_tf;
+  e->env_tf.tf_regs.reg_eax = 0;
+  sched_set_status(e, ENV_RUNNABLE);
+  return e->env_id;
+}
+
+// Set envid's scheduling priority to prio, one of the ENV_PRIO_* values
+// in inc/env.h (lower runs first).  New environments inherit their
+// parent's priority.  An env may lower its own or its children's
+// priority, but never raise either above its own base priority, so
+// user jobs can't compete with the servers the kernel starts at
+// ENV_PRIO_HIGH.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is not a valid priority, or is higher than the
+//		caller's own base priority.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+  struct Env *e = NULL;
+  int res = envid2env(envid, &e, 1);
+  if (res < 0) {
+    return res;
+  }
+  if (prio < curenv->env_prio || prio >= ENV_NPRIO) {
+    return -E_INVAL;
+  }
+  sched_set_priority(e, prio);
+  return 0;
+}
+
+// Block until time_nsec() reaches deadline, or return at once if it
+// already has.  Returns 0, or -E_NO_MEM if there is no memory to set
+// the timer with.
+static int
+sys_sleep_until(uint64_t deadline)
+{
+  int r;
+  if (deadline <= time_nsec()) {
+    return 0;
+  }
+  r = sched_sleep(curenv, deadline);
+  if (r < 0) {
+    return r;
+  }
+  curenv->env_tf.tf_regs.reg_eax = 0;
+  sched_yield();
+}
+
+// Block until another env calls sys_futex_wake on the word at addr,
+// or until time_nsec() reaches deadline if it is nonzero, provided the
+// word at addr still holds val.  Envs sharing a page wake each other
+// through it whatever address each maps it at.
+//
+// Returns 0 if woken, < 0 on error.  Errors are:
+//	-E_INVAL if addr is not word-aligned or is above ULIM.
+//	-E_FAULT if addr is not mapped user-readable.
+//	-E_AGAIN if the word at addr does not hold val.
+//	-E_TIMEOUT if the deadline passed first.
+//	-E_NO_MEM if there is no memory to set the deadline with.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, uint64_t deadline)
+{
+  int r = futex_wait(curenv, addr, val, deadline);
+  if (r < 0) {
+    return r;
+  }
+  sched_yield();
+}
+
+// Wake up to n envs blocked in sys_futex_wait on the word at addr,
+// longest-waiting first.
+//
+// Returns the number of envs woken, < 0 on error.  Errors are those
+// of sys_futex_wait for a bad addr, and -E_INVAL if n is negative.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+  if (n < 0) {
+    return -E_INVAL;
+  }
+  return futex_wake(curenv, addr, n);
+}
+
+// Restrict envid to the CPUs whose bits are set in mask.  Bit i stands
+// for CPU i; bits for CPUs that aren't up are ignored.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if mask names no CPU that is up.
+static int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+  struct Env *e = NULL;
+  int res = envid2env(envid, &e, 1);
+  if (res < 0) {
+    return res;
+  }
+  return sched_set_affinity(e, mask);
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -131,7 +284,7 @@ sys_env_set_status(envid_t envid, int status)
     return res;
   }
   if (status == ENV_NOT_RUNNABLE || status == ENV_RUNNABLE) {
-    e->env_status = status;
+    sched_set_status(e, status);
     return 0;
   }
   return -E_INVAL;
@@ -229,7 +382,7 @@ sys_page_alloc(envid_t envid, void *va, int perm)
   if (perm & ~PTE_SYSCALL) {
     return -E_INVAL;
   }
-  struct Page *pp = page_alloc(ALLOC_ZERO);
+  struct Page *pp = page_alloc_env(e, ALLOC_ZERO);
   if (pp == NULL) {
     return -E_NO_MEM;
   }
@@ -240,6 +393,44 @@ sys_page_alloc(envid_t envid, void *va, int perm)
   return res;
 }
 
+// Allocate a zeroed 4MB superpage and map it at 'va' in envid's address
+// space with permission 'perm', replacing anything mapped in that 4MB.
+// Perm has the same restrictions as in sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not PTSIZE-aligned.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no free, aligned 4MB of physical memory.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+  struct Env *e = NULL;
+  int res = envid2env(envid, &e, 1);
+  if (res < 0) {
+    return res;
+  }
+  uint32_t vaddr = (uint32_t)va;
+  if (vaddr >= UTOP || vaddr % PTSIZE) {
+    return -E_INVAL;
+  }
+  perm |= PTE_U;
+  perm |= PTE_P;
+  if (perm & ~PTE_SYSCALL) {
+    return -E_INVAL;
+  }
+  struct Page *pp = page_alloc_large(ALLOC_ZERO);
+  if (pp == NULL) {
+    return -E_NO_MEM;
+  }
+  res = page_insert(e->env_pgdir, pp, va, perm | PTE_PS);
+  if (res < 0) {
+    page_free(pp);
+  }
+  return res;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -255,6 +446,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva is in a superpage, which can only be mapped whole:
+//		srcva and dstva must both be PTSIZE-aligned.
 //	-E_NO_MEM if there's no memory to allocate any necessary page tables.
 static int
 sys_page_map(envid_t srcenvid, void *srcva,
@@ -295,10 +488,26 @@ sys_page_map(envid_t srcenvid, void *srcva,
   if ((perm & PTE_W) && (*pte & PTE_W) == 0) {
     return -E_INVAL;
   }
+  if (*pte & PTE_PS) {
+    if (srcvaddr % PTSIZE || dstvaddr % PTSIZE) {
+      return -E_INVAL;
+    }
+    perm |= PTE_PS;
+  }
   res = page_insert(dstenv->env_pgdir, pp, dstva, perm);
   return res;
 }
 
+// Whether page-aligned va lies inside a superpage mapped in pgdir but
+// not at its start.  page_remove of any page in a superpage removes
+// all 4MB, so an unmap is only allowed to start at a superpage's first
+// page, and then takes the whole superpage with it.
+static bool
+cuts_superpage(pde_t *pgdir, uint32_t va)
+{
+  return va % PTSIZE && (pgdir[PDX(va)] & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS);
+}
+
 // Unmap the page of memory at 'va' in the address space of 'envid'.
 // If no page is mapped, the function silently succeeds.
 //
@@ -306,6 +515,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_INVAL if va is in a superpage but not at its start.  Unmapping
+//		the start of a superpage unmaps the whole 4MB.
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -320,16 +531,215 @@ sys_page_unmap(envid_t envid, void *va)
   if (vaddr >= UTOP || vaddr % PGSIZE) {
     return -E_INVAL;
   }
+  if (cuts_superpage(e->env_pgdir, vaddr)) {
+    return -E_INVAL;
+  }
   page_remove(e->env_pgdir, va);
   return 0;
 }
 
+// Check that the npages pages starting at va are page-aligned and
+// lie entirely below UTOP.
+static bool
+page_range_ok(uint32_t va, size_t npages)
+{
+  return va % PGSIZE == 0 && npages <= UTOP / PGSIZE &&
+         va <= UTOP - npages * PGSIZE;
+}
+
+// Allocate npages zeroed pages and map them contiguously from 'va' in
+// envid's address space, as npages calls to sys_page_alloc would, but
+// with a single TLB flush.  Nothing is left mapped if it fails.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range crosses UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory for the pages or page tables.
+static int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+  struct Env *e = NULL;
+  struct Page *pp;
+  size_t i;
+  int res = envid2env(envid, &e, 1);
+  if (res < 0) {
+    return res;
+  }
+  if (!page_range_ok((uint32_t)va, npages)) {
+    return -E_INVAL;
+  }
+  perm |= PTE_U;
+  perm |= PTE_P;
+  if (perm & ~PTE_SYSCALL) {
+    return -E_INVAL;
+  }
+  tlb_batch_begin();
+  for (i = 0; i < npages; i++) {
+    pp = page_alloc_env(e, ALLOC_ZERO);
+    if (pp == NULL) {
+      res = -E_NO_MEM;
+      break;
+    }
+    res = page_insert(e->env_pgdir, pp, (char *)va + i * PGSIZE, perm);
+    if (res < 0) {
+      page_free(pp);
+      break;
+    }
+  }
+  if (res < 0) {
+    while (i-- > 0) {
+      page_remove(e->env_pgdir, (char *)va + i * PGSIZE);
+    }
+  }
+  tlb_batch_end();
+  return res;
+}
+
+// Map the npages pages starting at 'srcva' in srcenvid's address space
+// at 'dstva' in dstenvid's address space, as npages calls to
+// sys_page_map would.  The whole source range is checked before
+// anything is mapped, and the TLB is flushed once.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if either range is not page-aligned or crosses UTOP.
+//	-E_INVAL if any page in the source range is unmapped, or is part
+//		of a superpage.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but a source page is read-only.
+//	-E_NO_MEM if there's no memory to allocate any necessary page
+//		tables; the destination range is then left unmapped.
+static int
+sys_page_map_range(envid_t srcenvid, void *srcva,
+		   envid_t dstenvid, void *dstva, size_t npages, int perm)
+{
+  struct Env *srcenv = NULL;
+  struct Env *dstenv = NULL;
+  struct Page *pp;
+  pte_t *pte;
+  size_t i;
+  int res = envid2env(srcenvid, &srcenv, 1);
+  if (res < 0) {
+    return res;
+  }
+  res = envid2env(dstenvid, &dstenv, 1);
+  if (res < 0) {
+    return res;
+  }
+  if (!page_range_ok((uint32_t)srcva, npages) ||
+      !page_range_ok((uint32_t)dstva, npages)) {
+    return -E_INVAL;
+  }
+  perm |= PTE_U;
+  perm |= PTE_P;
+  if (perm & ~PTE_SYSCALL) {
+    return -E_INVAL;
+  }
+  for (i = 0; i < npages; i++) {
+    pte = NULL;
+    pp = page_lookup(srcenv->env_pgdir, (char *)srcva + i * PGSIZE, &pte);
+    if (pp == NULL || (*pte & PTE_PS)) {
+      return -E_INVAL;
+    }
+    if ((perm & PTE_W) && (*pte & PTE_W) == 0) {
+      return -E_INVAL;
+    }
+  }
+  tlb_batch_begin();
+  for (i = 0; i < npages; i++) {
+    pp = page_lookup(srcenv->env_pgdir, (char *)srcva + i * PGSIZE, NULL);
+    res = page_insert(dstenv->env_pgdir, pp, (char *)dstva + i * PGSIZE, perm);
+    if (res < 0) {
+      break;
+    }
+  }
+  if (res < 0) {
+    while (i-- > 0) {
+      page_remove(dstenv->env_pgdir, (char *)dstva + i * PGSIZE);
+    }
+  }
+  tlb_batch_end();
+  return res;
+}
+
+// Unmap the npages pages starting at 'va' in the address space of
+// 'envid', with a single TLB flush.  Unmapped pages are skipped.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range crosses UTOP.
+//	-E_INVAL if va is in a superpage but not at its start.  A
+//		superpage whose start is in the range is unmapped whole,
+//		even if the range ends inside it.
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+  struct Env *e = NULL;
+  size_t i;
+  int res = envid2env(envid, &e, 1);
+  if (res < 0) {
+    return res;
+  }
+  if (!page_range_ok((uint32_t)va, npages)
+      || (npages > 0 && cuts_superpage(e->env_pgdir, (uint32_t)va))) {
+    return -E_INVAL;
+  }
+  tlb_batch_begin();
+  for (i = 0; i < npages; i++) {
+    page_remove(e->env_pgdir, (char *)va + i * PGSIZE);
+  }
+  tlb_batch_end();
+  return 0;
+}
+
+// Reserve the npages pages starting at 'va' in envid's address space as
+// demand-zero memory: each page is allocated zeroed, with permission
+// 'perm', by the page fault handler the first time it is touched.
+// Unmapping a page of the region later makes it read back as zero.
+// Perm has the same restrictions as in sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va is not page-aligned or the range crosses UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if the range overlaps a region reserved earlier.
+//	-E_NO_MEM if envid already has NANONREGION regions.
+static int
+sys_page_reserve(envid_t envid, void *va, size_t npages, int perm)
+{
+  struct Env *e = NULL;
+  int res = envid2env(envid, &e, 1);
+  if (res < 0) {
+    return res;
+  }
+  if (!page_range_ok((uint32_t)va, npages)) {
+    return -E_INVAL;
+  }
+  perm |= PTE_U;
+  perm |= PTE_P;
+  if (perm & ~PTE_SYSCALL) {
+    return -E_INVAL;
+  }
+  return region_reserve(e, va, npages * PGSIZE, perm);
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// If perm includes IPC_MOVE, the page moves instead: it is unmapped
+// from the caller when the send succeeds, whether or not the receiver
+// asked for a page, saving the caller the sys_page_unmap.  The same
+// goes for the other IPC syscalls that send pages.
 //
-// The send fails with a return value of -E_IPC_NOT_RECV if the
-// target is not blocked, waiting for an IPC.
+// If the target is not blocked, waiting for an IPC, the message is
+// queued for it instead, and it gets the message as soon as it next
+// receives.  The send fails with a return value of -E_IPC_NOT_RECV only
+// if the target's queue of IPC_QUEUE_LEN messages is already full.
 //
 // The send also can fail for the other reasons listed below.
 //
@@ -338,7 +748,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_nwords is set to 0 (see sys_ipc_call for word messages).
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -351,8 +762,8 @@ sys_page_unmap(envid_t envid, void *va)
 // Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist.
 //		(No need to check permissions.)
-//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
-//		or another environment managed to send first.
+//	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv
+//		and its message queue is full.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
@@ -361,57 +772,197 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in the
 //		current environment's address space.
 //	-E_NO_MEM if there's not enough memory to map srcva in envid's
-//		address space.
+//		address space, or to give envid a message queue.
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
   int r;
   struct Env *e = NULL;
-  pte_t *pte = NULL;
-  struct Page *pp = NULL;
   int res = envid2env(envid, &e, 0);
   if (res < 0) {
     return res;
   }
-  if (e->env_ipc_recving) {
-    uint32_t va = (uint32_t)srcva;
-    if (va < UTOP && va % PGSIZE) {
-      return -E_INVAL;
+  if (!ipc_recving(e, curenv)) {
+    return ipc_enqueue(curenv, e, value, srcva, perm);
+  }
+  r = ipc_deliver(curenv, e, value, srcva, perm, NULL, 0);
+  if (r < 0) {
+    return r;
+  }
+  sched_wakeup(e);
+  return 0;
+}
+
+// Send 'value', and the page at 'srcva' if srcva < UTOP, to 'envid'
+// like sys_ipc_try_send, but if envid isn't receiving yet, block until
+// it is.  Blocked senders are queued on the receiver and served in
+// order by its sys_ipc_recv calls.  A nonzero 'deadline' bounds the
+// wait, in time_nsec() time.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send other than -E_IPC_NOT_RECV, and:
+//	-E_INVAL if envid is the caller's own env.
+//	-E_TIMEOUT if the deadline passed before envid received.
+//	-E_BAD_ENV if envid was destroyed before it received.
+//	-E_NO_MEM if there is no memory to set the deadline with.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+             uint64_t deadline)
+{
+  struct Env *e = NULL;
+  uint32_t va = (uint32_t)srcva;
+  int res = envid2env(envid, &e, 0);
+  if (res < 0) {
+    return res;
+  }
+  if (ipc_recving(e, curenv)) {
+    return sys_ipc_try_send(envid, value, srcva, perm);
+  }
+  if (e == curenv || (va < UTOP && va % PGSIZE)) {
+    return -E_INVAL;
+  }
+  if (deadline && deadline <= time_nsec()) {
+    return -E_TIMEOUT;
+  }
+  res = ipc_send_block(curenv, e, value, srcva, perm, NULL, 0, deadline,
+                       IPC_THEN_RETURN);
+  if (res < 0) {
+    return res;
+  }
+  sched_yield();
+}
+
+// Decode the message of sys_ipc_call and sys_ipc_reply_wait.  If
+// 'nwords' is nonzero, 'msg' points to that many words in the caller's
+// memory, which are copied to 'words' and sent in place of a page, so
+// that the receiver finds them in its env_ipc_words without any page
+// table changes.  Otherwise 'msg' packs srcva|perm as for sys_ipc_send.
+//
+// Returns 0 on success, -E_INVAL if nwords is more than IPC_NWORDS,
+// or -E_FAULT if the words aren't readable.
+static int
+ipc_msg_args(uint32_t msg, int nwords, uint32_t *words,
+             void **srcva, unsigned *perm)
+{
+  if (nwords > IPC_NWORDS) {
+    return -E_INVAL;
+  }
+  if (nwords == 0) {
+    *srcva = (void *)ROUNDDOWN(msg, PGSIZE);
+    *perm = PGOFF(msg);
+    return 0;
+  }
+  if (user_mem_check(curenv, (void *)msg, nwords * sizeof(uint32_t),
+                     PTE_U) < 0) {
+    return -E_FAULT;
+  }
+  memmove(words, (void *)msg, nwords * sizeof(uint32_t));
+  *srcva = (void *)UTOP;
+  *perm = 0;
+  return 0;
+}
+
+// Send 'value', and the page at 'srcva' if srcva < UTOP, to 'envid',
+// blocking until it receives as sys_ipc_send does, and then wait for
+// its reply, which only envid can send; a page it sends is mapped at
+// 'dstva' if dstva < UTOP.  If envid is already receiving, this CPU
+// switches straight to it, and it runs out the rest of our time slice.
+// 'msg' and 'nwords' are decoded by ipc_msg_args, so a short request
+// can go as words instead of a page.
+//
+// Returns the reply value, which is also in env_ipc_value, or < 0 on
+// error.  Errors are those of sys_ipc_send and ipc_msg_args, -E_INVAL
+// if dstva < UTOP but is not page-aligned, and -E_BAD_ENV if envid is
+// destroyed before replying.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, uint32_t msg, void *dstva,
+             int nwords)
+{
+  struct Env *e = NULL;
+  uint32_t words[IPC_NWORDS];
+  void *srcva;
+  unsigned perm;
+  int r = envid2env(envid, &e, 0);
+  if (r < 0) {
+    return r;
+  }
+  r = ipc_msg_args(msg, nwords, words, &srcva, &perm);
+  if (r < 0) {
+    return r;
+  }
+  if (e == curenv || ((uint32_t)srcva < UTOP && (uint32_t)srcva % PGSIZE)
+      || ((uint32_t)dstva < UTOP && (uint32_t)dstva % PGSIZE)) {
+    return -E_INVAL;
+  }
+  curenv->env_ipc_dstva = dstva;
+  curenv->env_ipc_recv_from = e->env_id;
+  if (!ipc_recving(e, curenv)) {
+    ipc_send_block(curenv, e, value, srcva, perm, words, nwords, 0,
+                   IPC_THEN_REPLY);
+    sched_yield();
+  }
+  r = ipc_deliver(curenv, e, value, srcva, perm, words, nwords);
+  if (r < 0) {
+    return r;
+  }
+  curenv->env_ipc_recving = 1;
+  sched_set_status(curenv, ENV_NOT_RUNNABLE);
+  sched_switch(e);
+}
+
+// Reply with 'value', and the page at 'srcva' if srcva < UTOP, to
+// 'envid', which is normally waiting in sys_ipc_call for us, and then
+// receive the next message like sys_ipc_recv(dstva).  If no message is
+// waiting, this CPU switches straight to envid.  If envid isn't
+// receiving yet, we block until it is, as in sys_ipc_send, so a client
+// that never receives holds the server up; an untrusted client should
+// be answered with sys_ipc_try_send instead.  Only a reply that can't
+// be delivered, or whose envid is gone, is dropped; envid 0 sends no
+// reply.
+// The reply is decoded from 'msg' and 'nwords' by ipc_msg_args.
+//
+// Errors are those of sys_ipc_recv and ipc_msg_args.
+static int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, uint32_t msg,
+                   void *dstva, int nwords)
+{
+  struct Env *e = NULL;
+  uint32_t words[IPC_NWORDS];
+  void *srcva;
+  unsigned perm;
+  int r = ipc_msg_args(msg, nwords, words, &srcva, &perm);
+  if (r < 0) {
+    return r;
+  }
+  if ((uint32_t)dstva < UTOP && (uint32_t)dstva % PGSIZE) {
+    return -E_INVAL;
+  }
+  curenv->env_ipc_dstva = dstva;
+  curenv->env_ipc_recv_from = 0;
+  if (envid != 0 && envid2env(envid, &e, 0) == 0 && e != curenv) {
+    if (!ipc_recving(e, curenv)) {
+      ipc_send_block(curenv, e, value, srcva, perm, words, nwords, 0,
+                     IPC_THEN_RECV);
+      sched_yield();
     }
-    if (va < UTOP) {
-      perm |= PTE_U;
-      perm |= PTE_P;
-      if (perm & ~PTE_SYSCALL) {
-        return -E_INVAL;
-      }
-      struct Page *pp = page_lookup(curenv->env_pgdir, srcva, &pte);
-      if (pp == NULL) {
-        return -E_INVAL;
-      }
-      if ((perm & PTE_W) && (*pte & PTE_W) == 0) {
-        return -E_INVAL;
-      }
-      if ((uint32_t)(e->env_ipc_dstva) < UTOP) {
-        r = page_insert(e->env_pgdir, pp, e->env_ipc_dstva, perm);
-        if (r < 0) {
-          return r;
-        }
-        e->env_ipc_perm = perm;
-      } else {
-        e->env_ipc_perm = 0;
-      }
-    } else {
-      e->env_ipc_perm = 0;
+    if (ipc_deliver(curenv, e, value, srcva, perm, words, nwords) < 0) {
+      e = NULL;
     }
-    e->env_ipc_value = value;
-    e->env_ipc_from = curenv->env_id;
-    e->env_ipc_recving = 0;
-    e->env_tf.tf_regs.reg_eax = 0;
-    e->env_status = ENV_RUNNABLE;
   } else {
-    return -E_IPC_NOT_RECV;
+    e = NULL;
   }
-  return 0;
+  curenv->env_ipc_recving = 1;
+  if (ipc_recv_queued(curenv)) {
+    if (e) {
+      sched_wakeup(e);
+    }
+    return 0;
+  }
+  sched_set_status(curenv, ENV_NOT_RUNNABLE);
+  if (e) {
+    sched_switch(e);
+  }
+  sched_yield();
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -421,6 +972,9 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If senders are blocked in sys_ipc_send waiting for us, take the
+// oldest one's message and return at once instead.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
@@ -434,16 +988,129 @@ sys_ipc_recv(void *dstva)
   }
   curenv->env_ipc_recving = 1;
   curenv->env_ipc_dstva = dstva;
-  curenv->env_status = ENV_NOT_RUNNABLE;
+  curenv->env_ipc_recv_from = 0;
+  if (ipc_recv_queued(curenv)) {
+    return 0;
+  }
+  sched_set_status(curenv, ENV_NOT_RUNNABLE);
 	sched_yield();
   return 0;
 }
 
+// Receive up to 'n' messages in one go, into 'msgs'.  Messages are
+// taken in the order sys_ipc_recv(dstva) would take them, and each is
+// stored as the ipc fields it would have left in struct Env.  A message
+// with a page ends the batch, since its page is mapped at 'dstva'.
+//
+// Returns the number of messages stored, if any were waiting.
+// Otherwise block as sys_ipc_recv does, and return 0 once a message
+// arrives, leaving it in the ipc fields of struct Env.
+// Returns < 0 on error.  Errors are:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if n isn't positive.
+//	-E_FAULT if msgs isn't writable.
+static int
+sys_ipc_recv_batch(void *dstva, struct IpcMsg *msgs, int n)
+{
+  int i;
+  if (((uint32_t)dstva < UTOP && (uint32_t)dstva % PGSIZE) || n <= 0
+      || n > ULIM / sizeof(struct IpcMsg)) {
+    return -E_INVAL;
+  }
+  if (user_mem_check(curenv, msgs, n * sizeof(struct IpcMsg),
+                     PTE_U | PTE_W) < 0) {
+    return -E_FAULT;
+  }
+  curenv->env_ipc_dstva = dstva;
+  curenv->env_ipc_recv_from = 0;
+  for (i = 0; i < n; i++) {
+    curenv->env_ipc_recving = 1;
+    if (!ipc_recv_queued(curenv)) {
+      break;
+    }
+    msgs[i].im_from = curenv->env_ipc_from;
+    msgs[i].im_value = curenv->env_ipc_value;
+    msgs[i].im_perm = curenv->env_ipc_perm;
+    msgs[i].im_nwords = curenv->env_ipc_nwords;
+    memmove(msgs[i].im_words, curenv->env_ipc_words,
+            sizeof(msgs[i].im_words));
+    if (curenv->env_ipc_perm) {
+      i++;
+      break;
+    }
+  }
+  if (i > 0) {
+    curenv->env_ipc_recving = 0;
+    return i;
+  }
+  sched_set_status(curenv, ENV_NOT_RUNNABLE);
+  sched_yield();
+}
+
+// Set up a ring channel (struct Chan) between the caller and 'peer':
+// allocate its CHAN_NPAGES zeroed pages and map them read/write at 'va'
+// in the caller and at 'peer_va' in peer, replacing whatever was
+// mapped there.  After this the two ends talk through the shared pages
+// and the futex syscalls alone.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment peer doesn't currently exist,
+//		or the caller doesn't have permission to change peer.
+//	-E_INVAL if va or peer_va is not page-aligned, or the channel
+//		would not fit below UTOP at either address.
+//	-E_NO_MEM if there's no memory for the pages or page tables.
+static int
+sys_chan_create(envid_t peer, void *va, void *peer_va)
+{
+  struct Env *e = NULL;
+  struct Page *pp;
+  int i, r;
+  int perm = PTE_U | PTE_W | PTE_P;
+  uint32_t size = CHAN_NPAGES * PGSIZE;
+  r = envid2env(peer, &e, 1);
+  if (r < 0) {
+    return r;
+  }
+  if ((uint32_t)va % PGSIZE || (uint32_t)va > UTOP - size
+      || (uint32_t)peer_va % PGSIZE || (uint32_t)peer_va > UTOP - size) {
+    return -E_INVAL;
+  }
+  for (i = 0; i < CHAN_NPAGES; i++) {
+    pp = page_alloc_env(curenv, ALLOC_ZERO);
+    if (pp == NULL) {
+      r = -E_NO_MEM;
+      break;
+    }
+    r = page_insert(curenv->env_pgdir, pp, va + i * PGSIZE, perm);
+    if (r < 0) {
+      page_free(pp);
+      break;
+    }
+    r = page_insert(e->env_pgdir, pp, peer_va + i * PGSIZE, perm);
+    if (r < 0) {
+      page_remove(curenv->env_pgdir, va + i * PGSIZE);
+      break;
+    }
+  }
+  if (r < 0) {
+    while (--i >= 0) {
+      page_remove(curenv->env_pgdir, va + i * PGSIZE);
+      page_remove(e->env_pgdir, peer_va + i * PGSIZE);
+    }
+  }
+  return r;
+}
+
 static int
 sys_sbrk(uint32_t inc)
 {
         uint32_t size = ROUNDUP(inc, PGSIZE);
-        region_alloc(curenv, (void *)curenv->env_break, size);
+        // The heap is demand-zero; allocate it up front only if the
+        // env has run out of region slots
+        if (region_reserve(curenv, (void *)curenv->env_break, size,
+                           PTE_U | PTE_W | PTE_P) < 0) {
+                region_alloc(curenv, (void *)curenv->env_break, size);
+        }
         curenv->env_break += size;
         return curenv->env_break;
 }
@@ -556,9 +1223,29 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
   case SYS_ipc_try_send:
     return sys_ipc_try_send(a1, a2, (void *)a3, a4);
     break;
+  case SYS_ipc_send:
+    // a3 packs the permission bits below the page-aligned srcva
+    return sys_ipc_send(a1, a2, (void *)ROUNDDOWN(a3, PGSIZE), PGOFF(a3),
+                        ((uint64_t) a5 << 32) | a4);
+    break;
+  case SYS_ipc_call:
+    // a4 packs the number of message words below the page-aligned dstva
+    return sys_ipc_call(a1, a2, a3, (void *)ROUNDDOWN(a4, PGSIZE),
+                        PGOFF(a4));
+    break;
+  case SYS_ipc_reply_wait:
+    return sys_ipc_reply_wait(a1, a2, a3, (void *)ROUNDDOWN(a4, PGSIZE),
+                              PGOFF(a4));
+    break;
   case SYS_ipc_recv:
     return sys_ipc_recv((void *)a1); /* no return */
     break;
+  case SYS_ipc_recv_batch:
+    return sys_ipc_recv_batch((void *)a1, (struct IpcMsg *)a2, a3);
+    break;
+  case SYS_chan_create:
+    return sys_chan_create(a1, (void *)a2, (void *)a3);
+    break;
   case SYS_env_set_trapframe:
     return sys_env_set_trapframe(a1, (struct Trapframe *)a2);
     break;
@@ -577,21 +1264,84 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
   case SYS_net_mac:
     return sys_net_mac((void *)a1);
     break;
+  case SYS_page_alloc_large:
+    return sys_page_alloc_large(a1, (void *)a2, a3);
+    break;
+  case SYS_fork_cow:
+    return sys_fork_cow();
+    break;
+  case SYS_page_alloc_range:
+    return sys_page_alloc_range(a1, (void *)a2, a3, a4);
+    break;
+  case SYS_page_map_range:
+    // a5 packs the page count above the permission bits
+    return sys_page_map_range(a1, (void *)a2, a3, (void *)a4, PGNUM(a5), PGOFF(a5));
+    break;
+  case SYS_page_unmap_range:
+    return sys_page_unmap_range(a1, (void *)a2, a3);
+    break;
+  case SYS_page_reserve:
+    return sys_page_reserve(a1, (void *)a2, a3, a4);
+    break;
+  case SYS_env_set_priority:
+    return sys_env_set_priority(a1, a2);
+    break;
+  case SYS_env_set_affinity:
+    return sys_env_set_affinity(a1, a2);
+    break;
+  case SYS_sleep_until:
+    return sys_sleep_until(((uint64_t) a2 << 32) | a1);
+    break;
+  case SYS_futex_wait:
+    return sys_futex_wait((uint32_t *)a1, a2, ((uint64_t) a4 << 32) | a3);
+    break;
+  case SYS_futex_wake:
+    return sys_futex_wake((uint32_t *)a1, a2);
+    break;
   }
   return -E_INVAL;
 }
 
+// Serve the syscalls that only read state no other CPU changes under
+// us, without taking the big kernel lock: curenv is only ever switched
+// by this CPU, and the tick count is a single word.  Returns true,
+// with the result in *ret, if num was one of them.
+bool
+syscall_nolock(uint32_t num, int32_t *ret)
+{
+  switch (num) {
+  case SYS_getenvid:
+    *ret = curenv->env_id;
+    return 1;
+  case SYS_time_msec:
+    *ret = time_msec();
+    return 1;
+  }
+  return 0;
+}
+
 int32_t
 syscall_tf(struct Trapframe *tf) {
   int32_t res;
+  if (syscall_nolock(tf->tf_regs.reg_eax, &res)) {
+    return res;
+  }
   lock_kernel();
   curenv->env_tf = *tf;
+  // sysenter cleared IF before the handler saved eflags; an env that
+  // blocks here must resume with interrupts on.
+  curenv->env_tf.tf_eflags |= FL_IF;
   res = syscall(tf->tf_regs.reg_eax,
                 tf->tf_regs.reg_edx,
                 tf->tf_regs.reg_ecx,
                 tf->tf_regs.reg_ebx,
                 tf->tf_regs.reg_edi,
                 0);
+  // The syscall may have woken an env that should preempt us
+  if (thiscpu->cpu_resched) {
+    curenv->env_tf.tf_regs.reg_eax = res;
+    sched_yield();
+  }
   unlock_kernel();
   return res;
 }
@@ -1,26 +1,105 @@
+#include <inc/x86.h>
+#include <inc/time.h>
 #include <kern/time.h>
+#include <kern/pmap.h>
+#include <kern/cpu.h>
 #include <inc/assert.h>
 
-static unsigned int ticks;
+// The PIT's input clock, and how long we let it run to calibrate
+#define PIT_HZ		1193182
+#define CALIBRATE_MS	10
+
+// The page mapped read-only at UTIME for user environments
+static struct TimePage *timepage;
+
+static uint64_t tsc_base, tsc_hz;
+static uint64_t lapic_hz;	// LAPIC timer ticks per second, divide by 1
+
+// Time one run of PIT channel 2 through CALIBRATE_MS milliseconds and
+// count how far the TSC and this CPU's LAPIC timer move meanwhile.
+// Returns false if the PIT never finished.
+static bool
+calibrate(void)
+{
+	uint32_t count = PIT_HZ * CALIBRATE_MS / 1000;
+	uint32_t lapic0, lapic1, spins = 0;
+	uint64_t tsc0, tsc1;
+	uint8_t gate;
+
+	// Gate channel 2 off with the speaker disconnected, load it in
+	// mode 0 (interrupt on terminal count), then gate it on: OUT2,
+	// bit 5 of port 0x61, goes high once the count runs out.
+	gate = inb(0x61) & ~0x03;
+	outb(0x61, gate);
+	outb(0x43, 0xB0);
+	outb(0x42, count & 0xFF);
+	outb(0x42, count >> 8);
+
+	lapic_timer_free_run();
+	lapic0 = lapic_timer_count();
+	tsc0 = read_tsc();
+	outb(0x61, gate | 0x01);
+	while (!(inb(0x61) & 0x20))
+		if (++spins == 0x10000000)
+			return 0;
+	tsc1 = read_tsc();
+	lapic1 = lapic_timer_count();
+	lapic_timer_oneshot(0);
+
+	tsc_hz = (tsc1 - tsc0) * 1000 / CALIBRATE_MS;
+	lapic_hz = (uint64_t) (lapic0 - lapic1) * 1000 / CALIBRATE_MS;
+	return tsc_hz && lapic_hz;
+}
 
 void
 time_init(void)
 {
-	ticks = 0;
+	struct Page *pp;
+
+	if (!calibrate()) {
+		// Fall back on what the kernel used to assume: a 1 GHz
+		// LAPIC bus, and a TSC running at the same rate.
+		cprintf("time: PIT calibration failed\n");
+		tsc_hz = lapic_hz = NSEC_PER_SEC;
+	}
+	tsc_base = read_tsc();
+	cprintf("time: TSC %u kHz, LAPIC timer %u kHz\n",
+		(uint32_t) (tsc_hz / 1000), (uint32_t) (lapic_hz / 1000));
+
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		panic("time_init: out of memory");
+	if (page_insert(kern_pgdir, pp, (void *) UTIME, PTE_U) < 0)
+		panic("time_init: cannot map the time page");
+	timepage = page2kva(pp);
+	timepage->tp_tsc_base = tsc_base;
+	timepage->tp_tsc_hz = tsc_hz;
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// Nanoseconds since time_init.
+uint64_t
+time_nsec(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	return tsc_to_nsec(read_tsc() - tsc_base, tsc_hz);
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_nsec() / NSEC_PER_MSEC;
+}
+
+// The LAPIC timer count that lasts ns nanoseconds, at least 1.  Waits
+// longer than a second are cut short, both to keep the arithmetic in 64
+// bits and to fit the 32-bit count; the timer code just re-arms.
+uint32_t
+time_lapic_count(uint64_t ns)
+{
+	uint64_t count;
+
+	if (ns > NSEC_PER_SEC)
+		ns = NSEC_PER_SEC;
+	count = ns * lapic_hz / NSEC_PER_SEC;
+	if (count > ~(uint32_t) 0)
+		return ~0;
+	return count ? count : 1;
 }
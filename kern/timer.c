@@ -0,0 +1,156 @@
+// Kernel timers: a per-CPU min-heap of deadlines, with the LAPIC timer
+// in one-shot mode interrupting for the earliest.
+
+#include <inc/assert.h>
+#include <inc/env.h>
+
+#include <kern/timer.h>
+#include <kern/time.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+// Every env may sleep, plus each CPU's time-slice timer
+#define TIMER_HEAP_MAX	(NENV + 1)
+
+struct timer_heap {
+	struct spinlock th_lock;
+	int th_n;
+	struct timer *th_timers[TIMER_HEAP_MAX];
+};
+
+static struct timer_heap heaps[NCPU];
+
+void
+timer_init(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		__spin_initlock(&heaps[i].th_lock, "timer_heap");
+}
+
+static void
+heap_put(struct timer_heap *h, int i, struct timer *t)
+{
+	h->th_timers[i] = t;
+	t->t_index = i;
+}
+
+// Move the timer in slot i up or down until the heap is ordered again.
+static void
+heap_fix(struct timer_heap *h, int i)
+{
+	struct timer *t = h->th_timers[i];
+	int child;
+
+	while (i > 0 && t->t_expire < h->th_timers[(i - 1) / 2]->t_expire) {
+		heap_put(h, i, h->th_timers[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < h->th_n) {
+		if (child + 1 < h->th_n
+		    && h->th_timers[child + 1]->t_expire < h->th_timers[child]->t_expire)
+			child++;
+		if (h->th_timers[child]->t_expire >= t->t_expire)
+			break;
+		heap_put(h, i, h->th_timers[child]);
+		i = child;
+	}
+	heap_put(h, i, t);
+}
+
+static void
+heap_remove(struct timer_heap *h, struct timer *t)
+{
+	int i = t->t_index;
+
+	t->t_pending = 0;
+	if (i != --h->th_n) {
+		heap_put(h, i, h->th_timers[h->th_n]);
+		heap_fix(h, i);
+	}
+}
+
+// Arm this CPU's LAPIC timer for its earliest deadline, or stop it.
+// The caller holds the heap lock.
+static void
+heap_program(struct timer_heap *h)
+{
+	uint64_t now;
+
+	if (h->th_n == 0) {
+		lapic_timer_oneshot(0);
+		return;
+	}
+	now = time_nsec();
+	lapic_timer_oneshot(time_lapic_count(h->th_timers[0]->t_expire > now
+					     ? h->th_timers[0]->t_expire - now : 0));
+}
+
+// Call func(t) on this CPU once time_nsec() reaches expire.  A timer that
+// is already set is moved.
+void
+timer_set(struct timer *t, uint64_t expire, void (*func)(struct timer *),
+	  void *arg)
+{
+	struct timer_heap *h = &heaps[cpunum()];
+
+	timer_cancel(t);
+	t->t_expire = expire;
+	t->t_func = func;
+	t->t_arg = arg;
+
+	spin_lock(&h->th_lock);
+	if (h->th_n == TIMER_HEAP_MAX)
+		panic("timer_set: too many timers on CPU %d", cpunum());
+	t->t_pending = 1;
+	t->t_cpu = cpunum();
+	heap_put(h, h->th_n++, t);
+	heap_fix(h, t->t_index);
+	if (h->th_timers[0] == t)
+		heap_program(h);
+	spin_unlock(&h->th_lock);
+}
+
+// Make sure t won't go off.  t may be set on any CPU.  If it is on
+// another CPU's heap and was its earliest, that CPU takes one early
+// interrupt and re-arms.
+void
+timer_cancel(struct timer *t)
+{
+	struct timer_heap *h;
+	int c;
+
+	if (!t->t_pending)
+		return;
+	c = t->t_cpu;
+	h = &heaps[c];
+	spin_lock(&h->th_lock);
+	if (t->t_pending && t->t_cpu == c) {
+		heap_remove(h, t);
+		if (c == cpunum())
+			heap_program(h);
+	}
+	spin_unlock(&h->th_lock);
+}
+
+// Called on this CPU's timer interrupt: run every timer that is due,
+// then re-arm for the next one.  Timer functions run without the heap
+// lock, so they may set timers themselves.
+void
+timer_interrupt(void)
+{
+	struct timer_heap *h = &heaps[cpunum()];
+	struct timer *t;
+
+	spin_lock(&h->th_lock);
+	while (h->th_n > 0 && h->th_timers[0]->t_expire <= time_nsec()) {
+		t = h->th_timers[0];
+		heap_remove(h, t);
+		spin_unlock(&h->th_lock);
+		t->t_func(t);
+		spin_lock(&h->th_lock);
+	}
+	heap_program(h);
+	spin_unlock(&h->th_lock);
+}
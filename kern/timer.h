@@ -0,0 +1,27 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// A one-shot kernel timer.  Each CPU keeps the timers set on it in a
+// min-heap ordered by deadline, and runs its LAPIC timer in one-shot
+// mode for the earliest one.
+struct timer {
+	uint64_t t_expire;		// Deadline, in time_nsec() time
+	void (*t_func)(struct timer *);	// Called on expiry, on t_cpu
+	void *t_arg;			// For t_func
+	bool t_pending;			// Set and not yet expired
+	int t_cpu;			// CPU whose heap holds us, if pending
+	int t_index;			// Our slot in that heap
+};
+
+void timer_init(void);
+void timer_set(struct timer *t, uint64_t expire,
+	       void (*func)(struct timer *), void *arg);
+void timer_cancel(struct timer *t);
+void timer_interrupt(void);
+
+#endif /* !JOS_KERN_TIMER_H */
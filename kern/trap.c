@@ -14,6 +14,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/timer.h>
 
 static struct Taskstate ts;
 
@@ -144,6 +145,8 @@ trap_init(void)
   SETGATE(idt[IRQ_OFFSET+14], 0, GD_KT, irq14_handler, 0);
   extern void irq15_handler();
   SETGATE(idt[IRQ_OFFSET+15], 0, GD_KT, irq15_handler, 0);
+  extern void wakeup_handler();
+  SETGATE(idt[IRQ_OFFSET+IRQ_WAKEUP], 0, GD_KT, wakeup_handler, 0);
 
 	// Per-CPU setup 
 	trap_init_percpu();
@@ -278,8 +281,26 @@ trap_dispatch(struct Trapframe *tf)
 	// interrupt using lapic_eoi() before calling the scheduler!
 	if (tf->tf_trapno == IRQ_OFFSET + 0) {
     lapic_eoi();
-    time_tick();
-    sched_yield();
+    timer_interrupt();
+    if (thiscpu->cpu_resched)
+      sched_yield();
+		return;
+	}
+
+	// A wakeup IPI gets a halted CPU out of sched_halt, or makes a
+	// running one reschedule (see sched_kick); trap() does the rest.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_WAKEUP) {
+		lapic_eoi();
+		return;
+	}
+
+	// A halted BSP takes keyboard and serial interrupts in the kernel.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
+		kbd_intr();
+		return;
+	}
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
+		serial_intr();
 		return;
 	}
 
@@ -302,6 +323,8 @@ trap_dispatch(struct Trapframe *tf)
 void
 trap(struct Trapframe *tf)
 {
+	int32_t ret;
+
 	// The environment may have set DF and some versions
 	// of GCC rely on DF being clear
 	asm volatile("cld" ::: "cc");
@@ -316,8 +339,23 @@ trap(struct Trapframe *tf)
 	// the interrupt path.
 	assert(!(read_eflags() & FL_IF));
 
+	// A CPU woken out of sched_halt comes here without the big kernel
+	// lock, and with time-slicing stopped.
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
+		lock_kernel();
+		sched_slice_start();
+	}
+
 	if ((tf->tf_cs & 3) == 3) {
 		// Trapped from user mode.
+		// Syscalls that don't need the big kernel lock go
+		// straight back to the environment (see _alltraps).
+		if (tf->tf_trapno == T_SYSCALL
+		    && syscall_nolock(tf->tf_regs.reg_eax, &ret)) {
+			tf->tf_regs.reg_eax = ret;
+			return;
+		}
+
 		// Acquire the big kernel lock before doing any
 		// serious kernel work.
     lock_kernel();
@@ -347,8 +385,9 @@ trap(struct Trapframe *tf)
 
 	// If we made it to this point, then no other environment was
 	// scheduled, so we should return to the current environment
-	// if doing so makes sense.
-	if (curenv && curenv->env_status == ENV_RUNNING)
+	// if doing so makes sense and no better env has woken up.
+	if (curenv && curenv->env_status == ENV_RUNNING
+	    && !thiscpu->cpu_resched)
 		env_run(curenv);
 	else
 		sched_yield();
@@ -368,6 +407,19 @@ page_fault_handler(struct Trapframe *tf)
           panic("page fault happens in kernel mode");
   }
 
+	// First touch of a demand-zero page, or a write to a page the
+	// kernel made copy-on-write: fix up the mapping and retry the
+	// access without bothering the env.  (The kernel does the same
+	// for pages it touches on the env's behalf in user_mem_check.)
+	if (fault_va < UTOP) {
+		if (!(tf->tf_err & FEC_PR)
+		    && region_fault(curenv, fault_va, tf->tf_err & FEC_WR) == 0)
+			return;
+		if ((tf->tf_err & (FEC_PR|FEC_WR)) == (FEC_PR|FEC_WR)
+		    && page_cow_fault(curenv, fault_va) == 0)
+			return;
+	}
+
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
@@ -24,8 +24,25 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			dstva, NULL);
+}
+
+// Like fsipc, but for a request whose 'len' bytes of arguments fit in
+// IPC_NWORDS words and that needs nothing back but the result.  The
+// arguments go in the message itself, so no page is mapped into the
+// file server and unmapped again.
+static int
+fsipc_words(unsigned type, const void *req, size_t len)
+{
+	static envid_t fsenv;
+	if (fsenv == 0)
+		fsenv = ipc_find_env(ENV_TYPE_FS);
+
+	if (debug)
+		cprintf("[%08x] fsipc_words %d\n", thisenv->env_id, type);
+
+	return ipc_callw(fsenv, type, req, len);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -96,8 +113,9 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	return fsipc(FSREQ_FLUSH, NULL);
+	struct Fsreq_flush req = { .req_fileid = fd->fd_file.id };
+
+	return fsipc_words(FSREQ_FLUSH, &req, sizeof(req));
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -162,9 +180,12 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	struct Fsreq_set_size req = {
+		.req_fileid = fd->fd_file.id,
+		.req_size = newsize
+	};
+
+	return fsipc_words(FSREQ_SET_SIZE, &req, sizeof(req));
 }
 
 // Delete a file
@@ -184,6 +205,6 @@ sync(void)
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_words(FSREQ_SYNC, NULL, 0);
 }
 
@@ -69,7 +69,7 @@ duppage(envid_t envid, unsigned pn)
 	int r;
   void *addr = (void *)(pn * PGSIZE);
   if ((vpd[PDX(addr)] & PTE_P) && (vpt[pn] & PTE_P)) {
-    if (vpt[pn] & (PTE_W | PTE_COW)) {
+    if (vpt[pn] & (PTE_W | PTE_COW | PTE_KCOW)) {
       // The ordering is important
       r = sys_page_map(0, addr, envid, addr, PTE_P|PTE_U|PTE_COW);
       if (r < 0) {
@@ -89,6 +89,79 @@ duppage(envid_t envid, unsigned pn)
 	return 0;
 }
 
+//
+// Give the child its own copy of the 4MB superpage at 'addr'.
+// A superpage cannot be made copy-on-write one 4KB page at a time, so
+// shared or read-only superpages are mapped into the child as they are
+// and writable ones are copied eagerly through UTEMP.
+//
+static int
+duplargepage(envid_t envid, void *addr)
+{
+  int r, r2;
+  pde_t pde = vpd[PDX(addr)];
+  if ((pde & PTE_SHARE) || !(pde & PTE_W)) {
+    return sys_page_map(0, addr, envid, addr, pde & PTE_SYSCALL);
+  }
+  r = sys_page_alloc_large(0, UTEMP, PTE_P|PTE_U|PTE_W);
+  if (r < 0) {
+    return r;
+  }
+  memmove(UTEMP, addr, PTSIZE);
+  r = sys_page_map(0, UTEMP, envid, addr, PTE_P|PTE_U|PTE_W);
+  if ((r2 = sys_page_unmap(0, UTEMP)) < 0 && r == 0) {
+    r = r2;
+  }
+  return r;
+}
+
+//
+// Reserve each of our demand-zero regions (see sys_page_reserve) in the
+// child envid as well.  Reads our regions through envs[] rather than
+// thisenv, which sfork clears.
+//
+static int
+dupanon(envid_t envid)
+{
+  const volatile struct Env *e = &envs[ENVX(sys_getenvid())];
+  int i, r;
+  for (i = 0; i < NANONREGION; i++) {
+    const volatile struct AnonRegion *ar = &e->env_anon[i];
+    if (ar->ar_start == ar->ar_end) {
+      continue;
+    }
+    r = sys_page_reserve(envid, (void *)ar->ar_start,
+                         (ar->ar_end - ar->ar_start) / PGSIZE, ar->ar_perm);
+    if (r < 0) {
+      return r;
+    }
+  }
+  return 0;
+}
+
+//
+// Fork with copy-on-write, letting the kernel duplicate the address
+// space in a single system call (sys_fork_cow).  The kernel marks the
+// shared pages PTE_KCOW and resolves write faults on them itself (see
+// page_cow_fault), including on pages an earlier ufork left PTE_COW,
+// so no user-level fault handler is needed; pgfault above only serves
+// ufork and sfork.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t envid;
+
+	envid = sys_fork_cow();
+	if (envid < 0)
+		panic("sys_fork_cow: %e", envid);
+	if (envid == 0)
+		thisenv = &envs[ENVX(sys_getenvid())];
+	return envid;
+}
+
 //
 // User-level fork with copy-on-write.
 // Set up our page fault handler appropriately.
@@ -106,7 +179,7 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	envid_t envid;
   unsigned pn, end;
@@ -135,6 +208,14 @@ fork(void)
   // Copy our address space with copy-on-write duppage
   end = UTOP / PGSIZE;
   for (pn = 0; pn < end; ++pn) {
+    if ((vpd[pn / NPTENTRIES] & (PTE_P|PTE_PS)) == (PTE_P|PTE_PS)) {
+      r = duplargepage(envid, (void *)(pn * PGSIZE));
+      if (r < 0) {
+        panic("fork: failed to duplicate superpage: %e", r);
+      }
+      pn += NPTENTRIES - 1;
+      continue;
+    }
     //   Neither user exception stack should ever be marked copy-on-write,
     if (pn != UXSTACKTOP / PGSIZE - 1) {
       r = duppage(envid, pn);
@@ -144,6 +225,12 @@ fork(void)
     }
   }
 
+  // The child's untouched demand-zero pages must fault in as zero too
+  r = dupanon(envid);
+  if (r < 0) {
+    panic("fork: sys_page_reserve: %e", r);
+  }
+
   // Allocate exception stack for child
   r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P);
   if (r < 0) {
@@ -199,6 +286,12 @@ sfork(void)
     }
   }
 
+  // The child's untouched demand-zero pages must fault in as zero too
+  r = dupanon(envid);
+  if (r < 0) {
+    panic("fork: sys_page_reserve: %e", r);
+  }
+
   // Allocate exception stack for child
   r = sys_page_alloc(envid, (void *)(UXSTACKTOP - PGSIZE), PTE_W | PTE_U | PTE_P);
   if (r < 0) {
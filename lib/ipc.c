@@ -1,6 +1,7 @@
 // User-level IPC library routines
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
@@ -63,12 +64,40 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 #endif
 }
 
+// Receive up to 'n' messages via IPC into 'msgs', waiting for the first
+// one if none is waiting, and return how many were received, or < 0 on
+// error.  Each IpcMsg holds what ipc_recv would have returned and
+// stored for that message.  Only the last one may carry a page, which
+// is mapped at 'pg' as in ipc_recv.
+int
+ipc_recv_batch(void *pg, struct IpcMsg *msgs, int n)
+{
+  int r;
+  if (pg == NULL) {
+    pg = (void *)UTOP;
+  }
+  // The kernel writes msgs directly, so make sure they aren't
+  // copy-on-write
+  memset(msgs, 0, n * sizeof(struct IpcMsg));
+  r = sys_ipc_recv_batch(pg, msgs, n);
+  if (r != 0) {
+    return r;
+  }
+  msgs[0].im_from = thisenv->env_ipc_from;
+  msgs[0].im_value = thisenv->env_ipc_value;
+  msgs[0].im_perm = thisenv->env_ipc_perm;
+  msgs[0].im_nwords = thisenv->env_ipc_nwords;
+  memmove(msgs[0].im_words, (const void *)thisenv->env_ipc_words,
+          sizeof(msgs[0].im_words));
+  return 1;
+}
+
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks until 'toenv' receives: the kernel queues us
+// on it, in order with any other senders already waiting.
+// It panics on any error.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -78,12 +107,166 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
   if (pg == NULL) {
     pg = (void *)UTOP;
   }
-  while((r = sys_ipc_try_send(to_env, val, pg, perm)) == -E_IPC_NOT_RECV) {
-    sys_yield();
+  if ((r = sys_ipc_send(to_env, val, pg, perm, 0)) < 0) {
+    panic("sys_ipc_send: %e", r);
+  }
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' like
+// ipc_send, then wait for its reply and return the reply value.  A page
+// in the reply is mapped at 'rcv_pg', if it is nonnull, and
+// 'perm_store' is set as for ipc_recv.  Only 'to_env' can reply, and the
+// kernel switches straight to it if it is already waiting, so this is
+// cheaper than ipc_send followed by ipc_recv.
+// Returns < 0 on error, like ipc_recv.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+  int32_t r;
+  if (pg == NULL) {
+    pg = (void *)UTOP;
+  }
+  if (rcv_pg == NULL) {
+    rcv_pg = (void *)UTOP;
+  }
+  r = sys_ipc_call(to_env, val, pg, perm, rcv_pg);
+  if (perm_store) {
+    *perm_store = thisenv->env_ipc_perm;
+  }
+  return r;
+}
+
+// Like ipc_call, but send the first 'len' bytes at 'words', rounded up
+// to whole words and at most IPC_NWORDS of them, in place of a page.
+// The receiver finds them in its env_ipc_words, so short requests
+// don't touch either side's page tables.
+int32_t
+ipc_callw(envid_t to_env, uint32_t val, const void *words, size_t len)
+{
+  int nwords = ROUNDUP(len, sizeof(uint32_t)) / sizeof(uint32_t);
+  if (nwords > IPC_NWORDS) {
+    return -E_INVAL;
+  }
+  return sys_ipc_callw(to_env, val, words, nwords, (void *)UTOP);
+}
+
+// Reply to a client blocked in ipc_call with 'val' (and 'pg' with 'perm',
+// if 'pg' is nonnull), then receive the next request like ipc_recv.
+// If the client isn't receiving yet, this waits until it is; a reply
+// that can't be delivered, or whose client is gone, is dropped, and
+// 'to_env' 0 sends none.  This is the server side of ipc_call: while
+// no request is waiting, the kernel switches straight back to the
+// client.
+int32_t
+ipc_reply_wait(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+  if (pg == NULL) {
+    pg = (void *)UTOP;
+  }
+  if (rcv_pg == NULL) {
+    rcv_pg = (void *)UTOP;
   }
+  int r = sys_ipc_reply_wait(to_env, val, pg, perm, rcv_pg);
   if (r < 0) {
-    panic("sys_ipc_try_send: %e", r);
+    if (from_env_store) {
+      *from_env_store = 0;
+    }
+    if (perm_store) {
+      *perm_store = 0;
+    }
+    return r;
+  }
+  if (from_env_store) {
+    *from_env_store = thisenv->env_ipc_from;
+  }
+  if (perm_store) {
+    *perm_store = thisenv->env_ipc_perm;
+  }
+  return thisenv->env_ipc_value;
+}
+
+// Set up a ring channel (struct Chan) between us and 'peer', mapped at
+// 'ch' here and at 'peer_ch' in peer; peer must be us or our child.
+// One end may then chan_send and the other chan_recv, with no system
+// calls at all unless the ring runs empty or full.
+int
+chan_create(envid_t peer, struct Chan *ch, struct Chan *peer_ch)
+{
+  static_assert(sizeof(struct Chan) == 2 * PGSIZE);
+  return sys_chan_create(peer, ch, peer_ch);
+}
+
+// Sleep until *idx, the other end's index, moves from 'val', after
+// finding the ring empty or full.  We set *waiting before looking at
+// *idx a last time, and the other end clears it with xchg after moving
+// *idx, so one of us sees the other: the wakeup can't be lost.  The
+// caller checks the ring again, since wakeups may be spurious.
+static void
+chan_wait(volatile uint32_t *idx, uint32_t val, volatile uint32_t *waiting)
+{
+  xchg(waiting, 1);
+  if (*idx == val) {
+    sys_futex_wait(idx, val, 0);
+  }
+  *waiting = 0;
+}
+
+// Wake the other end if it is asleep on our index, which we just moved.
+static void
+chan_notify(volatile uint32_t *idx, volatile uint32_t *waiting)
+{
+  if (xchg(waiting, 0)) {
+    sys_futex_wake(idx, 1);
+  }
+}
+
+// Send the 'len' bytes at 'msg' on channel 'ch', waiting for a free
+// slot if the ring is full.  Only one env may send on a channel.
+// Returns 0 on success, or -E_INVAL if len exceeds CHAN_MSGSIZE.
+int
+chan_send(struct Chan *ch, const void *msg, size_t len)
+{
+  uint32_t tail = ch->ch_tail;
+  struct ChanSlot *slot;
+  if (len > CHAN_MSGSIZE) {
+    return -E_INVAL;
+  }
+  while (tail - ch->ch_head == CHAN_NSLOTS) {
+    chan_wait(&ch->ch_head, tail - CHAN_NSLOTS, &ch->ch_send_waiting);
+  }
+  slot = &ch->ch_slots[tail % CHAN_NSLOTS];
+  slot->cs_len = len;
+  memmove(slot->cs_data, msg, len);
+  // The slot must be written before the receiver can see it
+  __asm __volatile("" : : : "memory");
+  ch->ch_tail = tail + 1;
+  chan_notify(&ch->ch_tail, &ch->ch_recv_waiting);
+  return 0;
+}
+
+// Receive the next message on channel 'ch' into 'buf', waiting for one
+// if the ring is empty.  Only one env may receive on a channel.
+// Returns the number of bytes stored, at most 'len'; any more of the
+// message is dropped.
+int
+chan_recv(struct Chan *ch, void *buf, size_t len)
+{
+  uint32_t head = ch->ch_head;
+  struct ChanSlot *slot;
+  while (ch->ch_tail == head) {
+    chan_wait(&ch->ch_tail, head, &ch->ch_recv_waiting);
   }
+  // Read the slot only after seeing the sender's tail
+  __asm __volatile("" : : : "memory");
+  slot = &ch->ch_slots[head % CHAN_NSLOTS];
+  len = MIN(len, slot->cs_len);
+  memmove(buf, slot->cs_data, len);
+  __asm __volatile("" : : : "memory");
+  ch->ch_head = head + 1;
+  chan_notify(&ch->ch_head, &ch->ch_send_waiting);
+  return len;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -41,7 +41,7 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	int i, npages;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
@@ -95,14 +95,15 @@ malloc(size_t n)
 	/*
 	 * allocate at mptr - the +4 makes sure we allocate a ref count.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	npages = ROUNDUP(n + 4, PGSIZE) / PGSIZE;
+	i = (npages - 1) * PGSIZE;
+	if (sys_page_alloc_range(0, mptr, npages - 1, PTE_P|PTE_U|PTE_W|PTE_CONTINUED) < 0)
+		return 0;	/* out of physical memory */
+	if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W) < 0) {
+		sys_page_unmap_range(0, mptr, npages - 1);
+		return 0;	/* out of physical memory */
 	}
+	i += PGSIZE;
 
 	ref = (uint32_t*) (mptr + i - 4);
 	*ref = 2;	/* reference for mptr, reference for returned block */
@@ -116,6 +117,7 @@ free(void *v)
 {
 	uint8_t *c;
 	uint32_t *ref;
+	size_t n;
 
 	if (v == 0)
 		return;
@@ -123,10 +125,11 @@ free(void *v)
 
 	c = ROUNDDOWN(v, PGSIZE);
 
-	while (vpt[PGNUM(c)] & PTE_CONTINUED) {
-		sys_page_unmap(0, c);
-		c += PGSIZE;
-		assert(mbegin <= c && c < mend);
+	for (n = 0; vpt[PGNUM(c + n * PGSIZE)] & PTE_CONTINUED; n++)
+		assert(c + (n + 1) * PGSIZE < mend);
+	if (n > 0) {
+		sys_page_unmap_range(0, c, n);
+		c += n * PGSIZE;
 	}
 
 	/*
@@ -25,8 +25,23 @@ nsipc(unsigned type)
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Like nsipc, but for a request whose 'len' bytes of arguments fit in
+// IPC_NWORDS words and that needs nothing back but the result.  The
+// arguments go in the message itself instead of in nsipcbuf's page.
+static int
+nsipc_words(unsigned type, const void *req, size_t len)
+{
+	static envid_t nsenv;
+	if (nsenv == 0)
+		nsenv = ipc_find_env(ENV_TYPE_NS);
+
+	if (debug)
+		cprintf("[%08x] nsipc_words %d\n", thisenv->env_id, type);
+
+	return ipc_callw(nsenv, type, req, len);
 }
 
 int
@@ -46,42 +61,51 @@ nsipc_accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 int
 nsipc_bind(int s, struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.bind.req_s = s;
-	memmove(&nsipcbuf.bind.req_name, name, namelen);
-	nsipcbuf.bind.req_namelen = namelen;
-	return nsipc(NSREQ_BIND);
+	struct Nsreq_bind req;
+
+	if (namelen > sizeof(req.req_name))
+		return -E_INVAL;
+	req.req_s = s;
+	memmove(&req.req_name, name, namelen);
+	req.req_namelen = namelen;
+	return nsipc_words(NSREQ_BIND, &req, sizeof(req));
 }
 
 int
 nsipc_shutdown(int s, int how)
 {
-	nsipcbuf.shutdown.req_s = s;
-	nsipcbuf.shutdown.req_how = how;
-	return nsipc(NSREQ_SHUTDOWN);
+	struct Nsreq_shutdown req = { .req_s = s, .req_how = how };
+
+	return nsipc_words(NSREQ_SHUTDOWN, &req, sizeof(req));
 }
 
 int
 nsipc_close(int s)
 {
-	nsipcbuf.close.req_s = s;
-	return nsipc(NSREQ_CLOSE);
+	struct Nsreq_close req = { .req_s = s };
+
+	return nsipc_words(NSREQ_CLOSE, &req, sizeof(req));
 }
 
 int
 nsipc_connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
-	nsipcbuf.connect.req_s = s;
-	memmove(&nsipcbuf.connect.req_name, name, namelen);
-	nsipcbuf.connect.req_namelen = namelen;
-	return nsipc(NSREQ_CONNECT);
+	struct Nsreq_connect req;
+
+	if (namelen > sizeof(req.req_name))
+		return -E_INVAL;
+	req.req_s = s;
+	memmove(&req.req_name, name, namelen);
+	req.req_namelen = namelen;
+	return nsipc_words(NSREQ_CONNECT, &req, sizeof(req));
 }
 
 int
 nsipc_listen(int s, int backlog)
 {
-	nsipcbuf.listen.req_s = s;
-	nsipcbuf.listen.req_backlog = backlog;
-	return nsipc(NSREQ_LISTEN);
+	struct Nsreq_listen req = { .req_s = s, .req_backlog = backlog };
+
+	return nsipc_words(NSREQ_LISTEN, &req, sizeof(req));
 }
 
 int
@@ -115,8 +139,11 @@ nsipc_send(int s, const void *buf, int size, unsigned int flags)
 int
 nsipc_socket(int domain, int type, int protocol)
 {
-	nsipcbuf.socket.req_domain = domain;
-	nsipcbuf.socket.req_type = type;
-	nsipcbuf.socket.req_protocol = protocol;
-	return nsipc(NSREQ_SOCKET);
+	struct Nsreq_socket req = {
+		.req_domain = domain,
+		.req_type = type,
+		.req_protocol = protocol
+	};
+
+	return nsipc_words(NSREQ_SOCKET, &req, sizeof(req));
 }
@@ -259,6 +259,7 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
 	int i, r;
+	size_t n;
 	void *blk;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
@@ -270,24 +271,24 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		fileoffset -= i;
 	}
 
-	for (i = 0; i < memsz; i += PGSIZE) {
-		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
-				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			if ((r = seek(fd, fileoffset + i)) < 0)
-				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
-		}
+	// Read the file-backed pages through UTEMP, as many at a time
+	// as fit below PFTEMP, and hand them to the child in one go
+	for (i = 0; i < filesz; i += n * PGSIZE) {
+		n = MIN(ROUNDUP(filesz - i, PGSIZE), (size_t) (PFTEMP - UTEMP)) / PGSIZE;
+		if ((r = sys_page_alloc_range(0, UTEMP, n, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = seek(fd, fileoffset + i)) < 0)
+			return r;
+		if ((r = readn(fd, UTEMP, MIN(n * PGSIZE, filesz - i))) < 0)
+			return r;
+		if ((r = sys_page_map_range(0, UTEMP, child, (void*) (va + i), n, perm)) < 0)
+			panic("spawn: sys_page_map_range data: %e", r);
+		sys_page_unmap_range(0, UTEMP, n);
 	}
+	// The rest of the segment is blank
+	if (i < memsz)
+		return sys_page_alloc_range(child, (void*) (va + i),
+					    (ROUNDUP(memsz, PGSIZE) - i) / PGSIZE, perm);
 	return 0;
 }
 
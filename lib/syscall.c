@@ -98,6 +98,18 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+envid_t
+sys_fork_cow(void)
+{
+	return syscall(SYS_fork_cow, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
@@ -110,6 +122,33 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_alloc_range(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_alloc_range, 1, envid, (uint32_t) va, npages, perm, 0);
+}
+
+int
+sys_page_map_range(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva,
+		   size_t npages, int perm)
+{
+	// Out of argument registers: the count goes above the perm bits
+	return syscall(SYS_page_map_range, 1, srcenv, (uint32_t) srcva,
+		dstenv, (uint32_t) dstva, (npages << PGSHIFT) | PGOFF(perm));
+}
+
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t npages)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, npages, 0, 0);
+}
+
+int
+sys_page_reserve(envid_t envid, void *va, size_t npages, int perm)
+{
+	return syscall(SYS_page_reserve, 1, envid, (uint32_t) va, npages, perm, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -130,6 +169,38 @@ sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 	return syscall(SYS_env_set_pgfault_upcall, 1, envid, (uint32_t) upcall, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
+int
+sys_env_set_affinity(envid_t envid, uint32_t mask)
+{
+	return syscall(SYS_env_set_affinity, 1, envid, mask, 0, 0, 0);
+}
+
+int
+sys_sleep_until(uint64_t deadline)
+{
+	return syscall(SYS_sleep_until, 0, (uint32_t) deadline,
+		       (uint32_t) (deadline >> 32), 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, uint64_t deadline)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val,
+		       (uint32_t) deadline, (uint32_t) (deadline >> 32), 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
 int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 {
@@ -142,6 +213,107 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_batch(void *dstva, struct IpcMsg *msgs, int n)
+{
+	return syscall(SYS_ipc_recv_batch, 0, (uint32_t) dstva,
+		       (uint32_t) msgs, n, 0, 0);
+}
+
+// The sending IPC syscalls are out of argument registers: the perm
+// bits go below srcva, so any "no page" srcva is passed as UTOP.
+static int
+ipc_pack(void *srcva, int perm, uint32_t *arg)
+{
+	if ((uint32_t) srcva >= UTOP)
+		srcva = (void *) UTOP;
+	else if (PGOFF(srcva))
+		return -E_INVAL;
+	*arg = (uint32_t) srcva | PGOFF(perm);
+	return 0;
+}
+
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm,
+	     uint64_t deadline)
+{
+	uint32_t a3;
+
+	if (ipc_pack(srcva, perm, &a3) < 0)
+		return -E_INVAL;
+	return syscall(SYS_ipc_send, 0, envid, value, a3,
+		       (uint32_t) deadline, (uint32_t) (deadline >> 32));
+}
+
+int32_t
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm,
+	     void *dstva)
+{
+	uint32_t a3;
+
+	if (ipc_pack(srcva, perm, &a3) < 0)
+		return -E_INVAL;
+	return syscall(SYS_ipc_call, 0, envid, value, a3, (uint32_t) dstva, 0);
+}
+
+int
+sys_ipc_reply_wait(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	uint32_t a3;
+
+	if (ipc_pack(srcva, perm, &a3) < 0)
+		return -E_INVAL;
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, a3,
+		       (uint32_t) dstva, 0);
+}
+
+// Pack a message of 'nwords' words at 'words' for sys_ipc_callw and
+// sys_ipc_reply_waitw: dstva is page-aligned, so the word count rides
+// in its low bits and the call still fits the sysenter registers.  No
+// words at all is a value-only message.
+static int
+ipc_pack_words(const uint32_t *words, int nwords, void *dstva,
+	       uint32_t *a3, uint32_t *a4)
+{
+	if ((uint32_t) dstva >= UTOP)
+		dstva = (void *) UTOP;
+	if (nwords < 0 || nwords > IPC_NWORDS || PGOFF(dstva))
+		return -E_INVAL;
+	*a3 = nwords ? (uint32_t) words : UTOP;
+	*a4 = (uint32_t) dstva | nwords;
+	return 0;
+}
+
+int32_t
+sys_ipc_callw(envid_t envid, uint32_t value, const uint32_t *words,
+	      int nwords, void *dstva)
+{
+	uint32_t a3, a4;
+
+	if (ipc_pack_words(words, nwords, dstva, &a3, &a4) < 0)
+		return -E_INVAL;
+	return syscall(SYS_ipc_call, 0, envid, value, a3, a4, 0);
+}
+
+int
+sys_ipc_reply_waitw(envid_t envid, uint32_t value, const uint32_t *words,
+		    int nwords, void *dstva)
+{
+	uint32_t a3, a4;
+
+	if (ipc_pack_words(words, nwords, dstva, &a3, &a4) < 0)
+		return -E_INVAL;
+	return syscall(SYS_ipc_reply_wait, 0, envid, value, a3, a4, 0);
+}
+
+int
+sys_chan_create(envid_t peer, void *va, void *peer_va)
+{
+	return syscall(SYS_chan_create, 1, peer, (uint32_t) va,
+		       (uint32_t) peer_va, 0, 0);
+}
+
 int
 sys_sbrk(uint32_t inc)
 {
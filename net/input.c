@@ -1,12 +1,11 @@
 #include "ns.h"
 #include <inc/lib.h>
 
-extern union Nsipc nsipcbuf;
-
 void
 input(envid_t ns_envid)
 {
   int r;
+  struct jif_pkt *pkt = (struct jif_pkt *)INPUT_PKTVA;
 	binaryname = "ns_input";
 
 	// LAB 6: Your code here:
@@ -15,17 +14,17 @@ input(envid_t ns_envid)
 	// Hint: When you IPC a page to the network server, it will be
 	// reading from it for a while, so don't immediately receive
 	// another packet in to the same physical page.
-  r = sys_page_alloc(0, &nsipcbuf, PTE_W|PTE_U|PTE_P);
+  // Each packet's page moves to the network server, and the next
+  // packet goes into the fresh page the demand-zero region gets on
+  // its next touch, without any further syscalls.
+  r = sys_page_reserve(0, pkt, 1, PTE_W|PTE_U|PTE_P);
   if (r < 0)
-    panic("sys_page_alloc: %e", r);
+    panic("sys_page_reserve: %e", r);
 
   for (;;) { // forever
-    nsipcbuf.pkt.jp_len = sys_net_try_receive(nsipcbuf.pkt.jp_data);
-    if (nsipcbuf.pkt.jp_len > 0) {
-      ipc_send(ns_envid, NSREQ_INPUT, &nsipcbuf, PTE_U|PTE_P);
-      r = sys_page_alloc(0, &nsipcbuf, PTE_W|PTE_U|PTE_P);
-      if (r < 0)
-        panic("sys_page_alloc: %e", r);
+    pkt->jp_len = sys_net_try_receive(pkt->jp_data);
+    if (pkt->jp_len > 0) {
+      ipc_send(ns_envid, NSREQ_INPUT, pkt, PTE_U|PTE_P|IPC_MOVE);
     }
   }
 }
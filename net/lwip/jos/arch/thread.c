@@ -1,4 +1,5 @@
 #include <inc/lib.h>
+#include <inc/time.h>
 
 #include <arch/thread.h>
 #include <arch/threadq.h>
@@ -31,26 +32,76 @@ thread_wakeup(volatile uint32_t *addr) {
     }
 }
 
+// Whether tc can run: it isn't in thread_wait, or its wait is over.
+static int
+thread_ready(struct thread_context *tc) {
+    uint32_t p;
+
+    if (!tc->tc_waiting || tc->tc_wakeup)
+	return 1;
+    if (tc->tc_wait_addr && *tc->tc_wait_addr != tc->tc_wait_val)
+	return 1;
+    p = time_msec();
+    return p >= tc->tc_wait_until || p < tc->tc_wait_start;
+}
+
+// The time_nsec() at which waiting thread tc times out, or 0 if never.
+// A timeout that has passed since thread_ready last looked gives the
+// present, so that thread_sleep returns at once.
+static uint64_t
+thread_deadline(struct thread_context *tc) {
+    int32_t left;
+
+    if (tc->tc_wait_until == (uint32_t)~0)
+	return 0;
+    left = tc->tc_wait_until - time_msec();
+    if (left <= 0)
+	return time_nsec();
+    return time_nsec() + (uint64_t)left * NSEC_PER_MSEC;
+}
+
+// Every thread is blocked in thread_wait.  Only another env could
+// change the words they wait on now, so sleep in the kernel until the
+// first timeout, on the futex of the thread it belongs to.
+static void
+thread_sleep(void) {
+    struct thread_context *tc, *first = NULL;
+    uint64_t d, first_d = 0;
+
+    if (cur_tc) {
+	first = cur_tc;
+	first_d = thread_deadline(cur_tc);
+    }
+    for (tc = thread_queue.tq_first; tc; tc = tc->tc_queue_link) {
+	d = thread_deadline(tc);
+	if (!first || (d && (!first_d || d < first_d))) {
+	    first = tc;
+	    first_d = d;
+	}
+    }
+
+    if (first->tc_wait_addr)
+	sys_futex_wait(first->tc_wait_addr, first->tc_wait_val, first_d);
+    else if (first_d)
+	sys_sleep_until(first_d);
+    else
+	sys_yield();
+}
+
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
-    uint32_t s = sys_time_msec();
-    uint32_t p = s;
-
     cur_tc->tc_wait_addr = addr;
+    cur_tc->tc_wait_val = val;
+    cur_tc->tc_wait_start = time_msec();
+    cur_tc->tc_wait_until = msec;
     cur_tc->tc_wakeup = 0;
+    cur_tc->tc_waiting = 1;
 
-    while (p < msec) {
-	if (p < s)
-	    break;
-	if (addr && *addr != val)
-	    break;
-	if (cur_tc->tc_wakeup)
-	    break;
-
+    // thread_yield only comes back to us once the wait is over
+    while (!thread_ready(cur_tc))
 	thread_yield();
-	p = sys_time_msec();
-    }
 
+    cur_tc->tc_waiting = 0;
     cur_tc->tc_wait_addr = 0;
     cur_tc->tc_wakeup = 0;
 }
@@ -159,12 +210,34 @@ thread_halt() {
     exit();
 }
 
+// Take the first thread that can run off the run queue, skipping
+// those still blocked in thread_wait.  Returns NULL if there is none.
+static struct thread_context *
+thread_pick(void) {
+    struct thread_context **pp, *tc, *prev = NULL;
+
+    for (pp = &thread_queue.tq_first; (tc = *pp); pp = &tc->tc_queue_link) {
+	if (thread_ready(tc)) {
+	    *pp = tc->tc_queue_link;
+	    if (thread_queue.tq_last == tc)
+		thread_queue.tq_last = prev;
+	    tc->tc_queue_link = 0;
+	    return tc;
+	}
+	prev = tc;
+    }
+    return 0;
+}
+
 void
 thread_yield(void) {
-    struct thread_context *next_tc = threadq_pop(&thread_queue);
+    struct thread_context *next_tc;
 
-    if (!next_tc)
-	return;
+    while (!(next_tc = thread_pick())) {
+	if (!thread_queue.tq_first || (cur_tc && thread_ready(cur_tc)))
+	    return;
+	thread_sleep();
+    }
 
     if (cur_tc) {
 	if (jos_setjmp(&cur_tc->tc_jb) != 0)
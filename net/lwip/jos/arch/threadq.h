@@ -25,6 +25,10 @@ struct thread_context {
     struct jos_jmp_buf	tc_jb;
     volatile uint32_t	*tc_wait_addr;
     volatile char	tc_wakeup;
+    char		tc_waiting;	// Blocked in thread_wait
+    uint32_t		tc_wait_val;
+    uint32_t		tc_wait_start;	// time_msec() thread_wait began
+    uint32_t		tc_wait_until;	// time_msec() it gives up, or ~0
     void		(*tc_onhalt[THREAD_NUM_ONHALT])(thread_id_t);
     int			tc_nonhalt;
     struct thread_context *tc_queue_link;
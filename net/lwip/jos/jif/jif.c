@@ -63,6 +63,13 @@ low_level_init(struct netif *netif)
     r = sys_net_mac((char *)netif->hwaddr);
     if (r < 0)
       panic("sys_net_mac failed");
+
+    /* Outgoing packets are built in a demand-zero page at PKTMAP,
+       which low_level_output moves to the output env, so each packet
+       gets a fresh page without any allocation or unmap syscalls. */
+    r = sys_page_reserve(0, (void *)PKTMAP, 1, PTE_U|PTE_W|PTE_P);
+    if (r < 0)
+      panic("jif: could not reserve the packet page: %e", r);
 }
 
 /*
@@ -76,9 +83,6 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
     struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
 
     struct jif *jif;
@@ -100,8 +104,8 @@ low_level_output(struct netif *netif, struct pbuf *p)
 
     pkt->jp_len = txsize;
 
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt,
+	     PTE_P|PTE_W|PTE_U|IPC_MOVE);
 
     return ERR_OK;
 }
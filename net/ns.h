@@ -11,6 +11,9 @@
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
+// Demand-zero page the input env receives packets into
+#define INPUT_PKTVA	(REQVA - PGSIZE)
+
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
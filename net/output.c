@@ -1,5 +1,11 @@
 #include "ns.h"
 #include <inc/lib.h>
+#include <inc/time.h>
+
+// How long to sleep when the transmit queue is full.  The E1000 driver
+// doesn't take interrupts, so there is no futex to wait on for free
+// descriptors; a few full-size frames drain in this time at 1Gb/s.
+#define TX_BACKOFF_NSEC	(50 * 1000)
 
 extern union Nsipc nsipcbuf;
 
@@ -17,7 +23,7 @@ output(envid_t ns_envid)
     r = ipc_recv(NULL, &nsipcbuf, NULL);
     if (r == NSREQ_OUTPUT) {
       while (sys_net_try_transmit(nsipcbuf.pkt.jp_data, nsipcbuf.pkt.jp_len) == -E_TX_QUEUE_FULL)
-        ; // empty body
+        sys_sleep_until(time_nsec() + TX_BACKOFF_NSEC);
     }
   }
 }
@@ -33,6 +33,9 @@ struct netif nif;
 
 #define debug 0
 
+// Most requests serve() takes in one ipc_recv_batch
+#define NS_BATCH 8
+
 struct timer_thread {
 	uint32_t msec;
 	void (*func)(void);
@@ -101,7 +104,7 @@ net_timer(uint32_t arg)
 	struct timer_thread *t = (struct timer_thread *) arg;
 
 	for (;;) {
-		uint32_t cur = sys_time_msec();
+		uint32_t cur = time_msec();
 
 		lwip_core_lock();
 		t->func();
@@ -169,9 +172,9 @@ process_timer(envid_t envid) {
 		return;
 	}
 
-	start = sys_time_msec();
+	start = time_msec();
 	thread_yield();
-	now = sys_time_msec();
+	now = time_msec();
 
 	to = TIMER_INTERVAL - (now - start);
 	ipc_send(envid, to, 0, 0);
@@ -181,8 +184,28 @@ struct st_args {
 	int32_t reqno;
 	uint32_t whom;
 	union Nsipc *req;
+	// Arguments of a request sent as message words; req points here
+	uint32_t words[IPC_NWORDS];
 };
 
+// Requests small enough for the client to send as message words
+// (see nsipc_words in lib/nsipc.c) instead of an argument page.
+static bool
+word_request(int32_t reqno)
+{
+	switch (reqno) {
+	case NSREQ_BIND:
+	case NSREQ_SHUTDOWN:
+	case NSREQ_CLOSE:
+	case NSREQ_CONNECT:
+	case NSREQ_LISTEN:
+	case NSREQ_SOCKET:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static void
 serve_thread(uint32_t a) {
 	struct st_args *args = (struct st_args *)a;
@@ -248,57 +271,81 @@ serve_thread(uint32_t a) {
 	if (args->reqno != NSREQ_INPUT)
 		ipc_send(args->whom, r, 0, 0);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	if (args->req != (union Nsipc *) args->words) {
+		put_buffer(args->req);
+		sys_page_unmap(0, (void*) args->req);
+	}
 	free(args);
 }
 
+// Handle one request received by serve(), whose argument page, if it
+// has one, is at va.
+static void
+serve_msg(struct IpcMsg *m, void *va)
+{
+	int32_t reqno = m->im_value;
+	uint32_t whom = m->im_from;
+
+	if (debug) {
+		cprintf("ns req %d from %08x\n", reqno, whom);
+	}
+
+	// first take care of requests that do not contain an argument page
+	if (reqno == NSREQ_TIMER) {
+		process_timer(whom);
+		return;
+	}
+
+	// All remaining requests must contain an argument page,
+	// except short ones, whose arguments may come in the
+	// message words
+	if (!(m->im_perm & PTE_P) && !word_request(reqno)) {
+		cprintf("Invalid request from %08x: no argument page\n", whom);
+		return; // just leave it hanging...
+	}
+
+	// Since some lwIP socket calls will block, create a thread and
+	// process the rest of the request in the thread.
+	struct st_args *args = malloc(sizeof(struct st_args));
+	if (!args)
+		panic("could not allocate thread args structure");
+
+	args->reqno = reqno;
+	args->whom = whom;
+	args->req = va;
+	if (!(m->im_perm & PTE_P)) {
+		memset(args->words, 0, sizeof(args->words));
+		memmove(args->words, m->im_words,
+			m->im_nwords * sizeof(uint32_t));
+		args->req = (union Nsipc *) args->words;
+	}
+
+	thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
+	thread_yield(); // let the thread created run
+}
+
 void
 serve(void) {
-	int32_t reqno;
-	uint32_t whom;
-	int i, perm;
+	static struct IpcMsg msgs[NS_BATCH];
+	int i, n;
 	void *va;
 
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
+		// ipc_recv_batch will block the entire process, so we flush
 		// all pending work from other threads.  We limit the
 		// number of yields in case there's a rogue thread.
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
-		perm = 0;
+		// Take all the requests waiting for us, up to NS_BATCH, in
+		// one system call.  Only the last can carry a page.
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
-		if (debug) {
-			cprintf("ns req %d from %08x\n", reqno, whom);
-		}
-
-		// first take care of requests that do not contain an argument page
-		if (reqno == NSREQ_TIMER) {
-			process_timer(whom);
+		if ((n = ipc_recv_batch(va, msgs, NS_BATCH)) < 0)
+			panic("ipc_recv_batch: %e", n);
+		if (!(msgs[n - 1].im_perm & PTE_P))
 			put_buffer(va);
-			continue;
-		}
-
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
-			cprintf("Invalid request from %08x: no argument page\n", whom);
-			continue; // just leave it hanging...
-		}
-
-		// Since some lwIP socket calls will block, create a thread and
-		// process the rest of the request in the thread.
-		struct st_args *args = malloc(sizeof(struct st_args));
-		if (!args)
-			panic("could not allocate thread args structure");
-
-		args->reqno = reqno;
-		args->whom = whom;
-		args->req = va;
-
-		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
-		thread_yield(); // let the thread created run
+		for (i = 0; i < n; i++)
+			serve_msg(&msgs[i], va);
 	}
 }
 
@@ -0,0 +1,25 @@
+// Test hard CPU affinity: pin ourselves to CPU 0 and check that we
+// never run anywhere else.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+
+	if ((r = sys_env_set_affinity(0, 0)) != -E_INVAL)
+		panic("empty affinity mask: got %e", r);
+	if ((r = sys_env_set_affinity(0, 0x80000000)) != -E_INVAL)
+		panic("affinity mask with no CPU up: got %e", r);
+
+	if ((r = sys_env_set_affinity(0, 1)) < 0)
+		panic("sys_env_set_affinity: %e", r);
+	for (i = 0; i < 100; i++) {
+		sys_yield();
+		if (thisenv->env_cpunum != 0)
+			panic("pinned to CPU 0 but running on CPU %d",
+			      thisenv->env_cpunum);
+	}
+	cprintf("affinity OK\n");
+}
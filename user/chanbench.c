@@ -0,0 +1,77 @@
+// Channel throughput benchmark: a stream of small messages goes from
+// one env to another, once with ipc_send and once through a ring
+// channel, and each run reports messages per second.
+
+#include <inc/lib.h>
+#include <inc/time.h>
+
+#define NMSG	100000
+#define CHANVA	((struct Chan *) 0x0f000000)
+
+static void
+recv_ipc(envid_t parent)
+{
+	uint32_t i;
+
+	for (i = 0; i < NMSG; i++)
+		if (ipc_recv(0, 0, 0) != i)
+			panic("ipc message %d out of order", i);
+	ipc_send(parent, 0, 0, 0);
+	exit();
+}
+
+static void
+recv_chan(envid_t parent)
+{
+	uint32_t i, msg;
+
+	// Wait for the parent to map the channel
+	ipc_recv(0, 0, 0);
+	for (i = 0; i < NMSG; i++)
+		if (chan_recv(CHANVA, &msg, sizeof(msg)) != sizeof(msg)
+		    || msg != i)
+			panic("channel message %d out of order", i);
+	ipc_send(parent, 0, 0, 0);
+	exit();
+}
+
+// Messages per second sent to a child running recv
+static uint64_t
+run(void (*recv)(envid_t), int chan)
+{
+	envid_t parent = thisenv->env_id, who;
+	uint64_t start;
+	uint32_t i;
+	int r;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0)
+		recv(parent);
+
+	if (chan) {
+		if ((r = chan_create(who, CHANVA, CHANVA)) < 0)
+			panic("chan_create: %e", r);
+		ipc_send(who, 0, 0, 0);
+	}
+	start = time_nsec();
+	for (i = 0; i < NMSG; i++)
+		if (chan)
+			chan_send(CHANVA, &i, sizeof(i));
+		else
+			ipc_send(who, i, 0, 0);
+	ipc_recv(0, 0, 0);
+	start = time_nsec() - start;
+	if (chan)
+		sys_page_unmap_range(0, CHANVA, CHAN_NPAGES);
+	return NMSG * NSEC_PER_SEC / start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	cprintf("ipc_send: %u messages/sec\n",
+		(uint32_t) run(recv_ipc, 0));
+	cprintf("channel: %u messages/sec\n",
+		(uint32_t) run(recv_chan, 1));
+}
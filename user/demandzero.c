@@ -0,0 +1,54 @@
+// Test demand-zero regions: reserve a large sparse range and check that
+// pages appear, zeroed, only when touched.
+
+#include <inc/lib.h>
+
+#define REGION		((char *) 0x20000000)
+#define REGIONPAGES	(64 * 1024 * 1024 / PGSIZE)
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	char *p;
+
+	if ((r = sys_page_reserve(0, REGION, REGIONPAGES, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	if ((r = sys_page_reserve(0, REGION + PGSIZE, 1, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("overlapping sys_page_reserve: got %e", r);
+
+	// Touch one page in every 4MB
+	for (i = 0; i < REGIONPAGES; i += NPTENTRIES) {
+		p = REGION + i * PGSIZE;
+		if (vpd[PDX(p)] & PTE_P && vpt[PGNUM(p)] & PTE_P)
+			panic("page %d mapped before it was touched", i);
+		if (p[PGSIZE - 1] != 0)
+			panic("page %d not zero", i);
+		p[0] = 1;
+		if (!(vpt[PGNUM(p)] & PTE_W))
+			panic("page %d not writable", i);
+	}
+
+	// Untouched pages that are only read share the zero page
+	p = REGION + 2 * PGSIZE;
+	if (p[0] != 0 || p[PGSIZE] != 0)
+		panic("read of untouched page not zero");
+	if (PTE_ADDR(vpt[PGNUM(p)]) != PTE_ADDR(vpt[PGNUM(p + PGSIZE)])
+	    || (vpt[PGNUM(p)] & PTE_W))
+		panic("untouched pages do not share a read-only zero page");
+	p[0] = 1;
+	if (p[PGSIZE] != 0 || PTE_ADDR(vpt[PGNUM(p)]) == PTE_ADDR(vpt[PGNUM(p + PGSIZE)]))
+		panic("write to the zero page was not copied");
+
+	// The kernel fills in untouched pages it is asked to read
+	p = REGION + PGSIZE;
+	sys_cputs(p, 1);
+
+	// An unmapped page of the region comes back as zero
+	REGION[0] = 1;
+	sys_page_unmap(0, REGION);
+	if (REGION[0] != 0)
+		panic("unmapped page did not come back zero");
+
+	cprintf("demandzero OK\n");
+}
@@ -0,0 +1,43 @@
+// Compare fork latency of the user-level copy-on-write fork (ufork)
+// with the in-kernel one (fork, via sys_fork_cow).
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NFORK	32
+#define NDIRTY	128		// pages of heap to give the parent some state
+
+static char buf[NDIRTY * PGSIZE];
+
+static uint64_t
+bench(const char *name, envid_t (*forkfn)(void))
+{
+	int i;
+	envid_t child;
+	uint64_t start, total = 0;
+
+	for (i = 0; i < NFORK; i++) {
+		start = read_tsc();
+		if ((child = forkfn()) < 0)
+			panic("%s: %e", name, child);
+		if (child == 0)
+			exit();
+		total += read_tsc() - start;
+		while (envs[ENVX(child)].env_status != ENV_FREE)
+			sys_yield();
+	}
+	cprintf("%s: %u cycles per fork\n", name, (uint32_t) (total / NFORK));
+	return total;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; i < NDIRTY; i++)
+		buf[i * PGSIZE] = i;
+
+	bench("ufork", ufork);
+	bench("fork", fork);
+}
@@ -0,0 +1,60 @@
+// Test sys_futex_wait and sys_futex_wake: a parent and child hand a
+// shared word back and forth, each sleeping on it until the other
+// changes it.  Also check the -E_AGAIN and -E_TIMEOUT cases.
+
+#include <inc/lib.h>
+#include <inc/time.h>
+
+#define SHARED		((volatile uint32_t *) 0xA0000000)
+#define ROUNDS		100
+#define TIMEOUT_NSEC	(20 * NSEC_PER_MSEC)
+
+// Sleep until *SHARED is no longer old.
+static void
+wait_change(uint32_t old)
+{
+	int r;
+
+	while (*SHARED == old)
+		if ((r = sys_futex_wait(SHARED, old, 0)) < 0 && r != -E_AGAIN)
+			panic("sys_futex_wait: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint64_t deadline;
+	int i, r;
+	envid_t child;
+
+	if ((r = sys_page_alloc(0, (void *) SHARED, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((r = sys_futex_wait(SHARED, 1, 0)) != -E_AGAIN)
+		panic("futex_wait on a changed word returned %e", r);
+	if ((r = sys_futex_wait((uint32_t *) ((char *) SHARED + 1), 0, 0)) != -E_INVAL)
+		panic("futex_wait on a misaligned word returned %e", r);
+	deadline = time_nsec() + TIMEOUT_NSEC;
+	if ((r = sys_futex_wait(SHARED, 0, deadline)) != -E_TIMEOUT)
+		panic("futex_wait with a timeout returned %e", r);
+	if (time_nsec() < deadline)
+		panic("futex_wait timed out early");
+	if ((r = sys_futex_wake(SHARED, 1)) != 0)
+		panic("futex_wake with no waiters woke %d", r);
+
+	// The parent moves the word from even to odd, the child from odd
+	// to even.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	for (i = 0; i < ROUNDS; i++) {
+		if (child == 0)
+			wait_change(2 * i);
+		*SHARED = 2 * i + 1 + (child == 0);
+		if ((r = sys_futex_wake(SHARED, 1)) < 0)
+			panic("sys_futex_wake: %e", r);
+		if (child != 0)
+			wait_change(2 * i + 1);
+	}
+	if (child != 0)
+		cprintf("futex OK\n");
+}
@@ -0,0 +1,54 @@
+// Test IPC_MOVE: a page sent with it ends up mapped only in the
+// receiver, both when it is delivered at once and when it is queued
+// for a receiver that isn't receiving yet.
+
+#include <inc/lib.h>
+
+#define RECVVA	((char *) 0xa0000000)
+
+static const char *str[] = { "moved while receiving", "moved via the queue" };
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, child;
+	int i, r, perm;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < 2; i++) {
+			r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W);
+			if (r < 0)
+				panic("sys_page_alloc: %e", r);
+			strcpy(UTEMP, str[i]);
+			// The first send waits for the parent to receive; the
+			// second finds it asleep, so the message is queued.
+			if (i == 0)
+				ipc_send(parent, i, UTEMP,
+					 PTE_P | PTE_U | PTE_W | IPC_MOVE);
+			else {
+				r = sys_ipc_try_send(parent, i, UTEMP,
+						     PTE_P | PTE_U | IPC_MOVE);
+				if (r < 0)
+					panic("sys_ipc_try_send: %e", r);
+			}
+			if (pageref(UTEMP) != 0)
+				panic("page %d still mapped after the move", i);
+		}
+		exit();
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (i == 1)
+			sys_sleep_until(time_nsec() + 10 * 1000 * 1000);
+		if ((r = ipc_recv(NULL, RECVVA, &perm)) != i)
+			panic("received %d, expected %d", r, i);
+		if (!(perm & PTE_P) || strcmp(RECVVA, str[i]) != 0)
+			panic("page %d holds \"%s\", perm %x", i, RECVVA, perm);
+		if (pageref(RECVVA) != 1)
+			panic("page %d has %d references after the move",
+			      i, pageref(RECVVA));
+	}
+	cprintf("ipcmove ok\n");
+}
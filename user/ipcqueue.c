@@ -0,0 +1,72 @@
+// Test per-env message queues: sys_ipc_try_send to an env that isn't
+// receiving queues the message instead of failing, until the queue is
+// full, and ipc_recv_batch takes the queued messages in order, many at
+// a time, stopping after one that carries a page.
+
+#include <inc/lib.h>
+
+#define NMSG	8
+#define RECVVA	((char *) 0xa0000000)
+
+static const char str[] = "a queued page";
+
+// Wait until child has exited
+static void
+wait_exit(envid_t child)
+{
+	const volatile struct Env *e = &envs[ENVX(child)];
+
+	while (e->env_id == child && e->env_status != ENV_FREE)
+		sys_yield();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, child;
+	struct IpcMsg msgs[4 * NMSG];
+	int i, n, r;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < NMSG; i++)
+			if ((r = sys_ipc_try_send(parent, i, (void *) UTOP, 0)) < 0)
+				panic("sys_ipc_try_send %d: %e", i, r);
+		if ((r = sys_page_alloc(0, UTEMP, PTE_P | PTE_U | PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		strcpy(UTEMP, str);
+		if ((r = sys_ipc_try_send(parent, NMSG, UTEMP, PTE_P | PTE_U)) < 0)
+			panic("sys_ipc_try_send with a page: %e", r);
+		exit();
+	}
+	wait_exit(child);
+	if ((n = ipc_recv_batch(RECVVA, msgs, 4 * NMSG)) != NMSG + 1)
+		panic("ipc_recv_batch returned %d, expected %d", n, NMSG + 1);
+	for (i = 0; i < n; i++)
+		if (msgs[i].im_from != child || msgs[i].im_value != i
+		    || (msgs[i].im_perm != 0) != (i == NMSG))
+			panic("message %d is %d from %08x, perm %x", i,
+			      msgs[i].im_value, msgs[i].im_from, msgs[i].im_perm);
+	if (strcmp(RECVVA, str) != 0)
+		panic("the queued page holds \"%s\"", RECVVA);
+
+	// Fill our queue; the messages still all arrive, in order.
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		i = 0;
+		while ((r = sys_ipc_try_send(parent, i, (void *) UTOP, 0)) == 0)
+			i++;
+		if (r != -E_IPC_NOT_RECV || i == 0 || i >= 4 * NMSG)
+			panic("sys_ipc_try_send %d to a full queue returned %e",
+			      i, r);
+		exit();
+	}
+	wait_exit(child);
+	n = ipc_recv_batch(NULL, msgs, 4 * NMSG);
+	for (i = 0; i < n; i++)
+		if (msgs[i].im_value != i)
+			panic("queued message %d is %d", i, msgs[i].im_value);
+	cprintf("ipcqueue ok: %d messages queued\n", n);
+}
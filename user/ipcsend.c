@@ -0,0 +1,62 @@
+// Test blocking sys_ipc_send: senders that block on a receiver are
+// served in the order they blocked, a send can time out, and a send to
+// an env that exits without receiving fails.
+
+#include <inc/lib.h>
+#include <inc/time.h>
+
+#define NSENDER		4
+#define STAGGER_NSEC	(10 * NSEC_PER_MSEC)
+
+// Fork a child that sleeps for nsec and then exits without receiving.
+static envid_t
+fork_sleeper(uint64_t nsec)
+{
+	envid_t child;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		sys_sleep_until(time_nsec() + nsec);
+		exit();
+	}
+	return child;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = thisenv->env_id, child, from;
+	uint64_t start;
+	int i, r;
+
+	// Each child blocks sending to us STAGGER_NSEC after the last one,
+	// and we only start receiving after they have all blocked.
+	start = time_nsec();
+	for (i = 0; i < NSENDER; i++) {
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0) {
+			sys_sleep_until(start + (i + 1) * STAGGER_NSEC);
+			ipc_send(parent, i, 0, 0);
+			exit();
+		}
+	}
+	sys_sleep_until(start + (NSENDER + 2) * STAGGER_NSEC);
+	for (i = 0; i < NSENDER; i++)
+		if ((r = ipc_recv(&from, 0, 0)) != i)
+			panic("received %d from %08x, expected %d", r, from, i);
+
+	child = fork_sleeper(10 * STAGGER_NSEC);
+	start = time_nsec();
+	if ((r = sys_ipc_send(child, 0, 0, 0, start + STAGGER_NSEC)) != -E_TIMEOUT)
+		panic("sys_ipc_send with a deadline returned %e", r);
+	if (time_nsec() < start + STAGGER_NSEC)
+		panic("sys_ipc_send timed out early");
+
+	child = fork_sleeper(STAGGER_NSEC);
+	if ((r = sys_ipc_send(child, 0, 0, 0, 0)) != -E_BAD_ENV)
+		panic("sys_ipc_send to an exiting env returned %e", r);
+
+	cprintf("ipcsend OK\n");
+}
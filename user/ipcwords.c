@@ -0,0 +1,62 @@
+// Test word messages: ipc_callw carries its words to the server in
+// env_ipc_words with no page mapped, the server can reply with words of
+// its own, and messages longer than IPC_NWORDS are refused.
+
+#include <inc/lib.h>
+
+#define NCALL	100
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t words[IPC_NWORDS + 1];
+	envid_t server, whom;
+	int32_t req;
+	int i, j, nwords, perm, r;
+
+	if ((server = fork()) < 0)
+		panic("fork: %e", server);
+	if (server == 0) {
+		// Echo each request's words back, reversed, with their count
+		// as the value.
+		req = ipc_reply_wait(0, 0, NULL, 0, &whom, NULL, &perm);
+		while (1) {
+			nwords = thisenv->env_ipc_nwords;
+			if (perm != 0 || nwords != req)
+				panic("server got %d words, perm %x for request %d",
+				      nwords, perm, req);
+			for (j = 0; j < nwords; j++)
+				words[j] = thisenv->env_ipc_words[nwords - 1 - j];
+			r = sys_ipc_reply_waitw(whom, nwords, words, nwords,
+						(void *) UTOP);
+			if (r < 0)
+				panic("sys_ipc_reply_waitw: %e", r);
+			whom = thisenv->env_ipc_from;
+			perm = thisenv->env_ipc_perm;
+			req = thisenv->env_ipc_value;
+		}
+	}
+
+	for (i = 0; i < NCALL; i++) {
+		nwords = i % (IPC_NWORDS + 1);
+		for (j = 0; j < nwords; j++)
+			words[j] = i * IPC_NWORDS + j;
+		if ((r = ipc_callw(server, nwords, words,
+				   nwords * sizeof(uint32_t))) != nwords)
+			panic("call %d returned %e, expected %d", i, r, nwords);
+		if (thisenv->env_ipc_nwords != nwords)
+			panic("call %d got %d words back, expected %d",
+			      i, thisenv->env_ipc_nwords, nwords);
+		for (j = 0; j < nwords; j++)
+			if (thisenv->env_ipc_words[j] != words[nwords - 1 - j])
+				panic("call %d word %d is %d", i, j,
+				      thisenv->env_ipc_words[j]);
+	}
+
+	if ((r = ipc_callw(server, 0, words, sizeof(words))) != -E_INVAL)
+		panic("ipc_callw with %d words returned %e",
+		      IPC_NWORDS + 1, r);
+
+	sys_env_destroy(server);
+	cprintf("ipcwords ok\n");
+}
@@ -0,0 +1,49 @@
+// Test 4MB superpage mappings: allocate one, touch every page of it,
+// and check that a forked child gets its own copy.
+
+#include <inc/lib.h>
+
+#define LARGEVA	((char *) 0x10000000)
+
+void
+umain(int argc, char **argv)
+{
+	int i, r;
+	envid_t child;
+
+	if ((r = sys_page_alloc_large(0, LARGEVA, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+	if (!(vpd[PDX(LARGEVA)] & PTE_PS))
+		panic("superpage not mapped with PTE_PS");
+
+	for (i = 0; i < PTSIZE; i += PGSIZE) {
+		if (LARGEVA[i] != 0)
+			panic("superpage not zeroed at offset %x", i);
+		LARGEVA[i] = i / PGSIZE;
+	}
+
+	if ((r = sys_page_map(0, LARGEVA + PGSIZE, 0, UTEMP, PTE_P|PTE_U)) != -E_INVAL)
+		panic("sys_page_map of a superpage fragment: got %e", r);
+	if ((r = sys_page_unmap(0, LARGEVA + PGSIZE)) != -E_INVAL)
+		panic("sys_page_unmap of a superpage fragment: got %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		for (i = 0; i < PTSIZE; i += PGSIZE)
+			if (LARGEVA[i] != (char) (i / PGSIZE))
+				panic("child: wrong data at offset %x", i);
+		LARGEVA[0] = 'c';
+		exit();
+	}
+	while (envs[ENVX(child)].env_status != ENV_FREE)
+		sys_yield();
+	if (LARGEVA[0] != 0)
+		panic("child write leaked into parent");
+
+	if ((r = sys_page_unmap(0, LARGEVA)) < 0)
+		panic("sys_page_unmap: %e", r);
+	if (vpd[PDX(LARGEVA)] & PTE_P)
+		panic("superpage still mapped after sys_page_unmap");
+	cprintf("largepage OK\n");
+}
@@ -0,0 +1,72 @@
+// Ping-pong latency benchmark: like pingpong, a counter goes back and
+// forth between two envs, but timed, and both envs share one CPU.
+// Round trips made with ipc_send and ipc_recv go through the scheduler
+// twice; those made with ipc_call and ipc_reply_wait switch straight
+// from one env to the other.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUND	10000
+
+static void
+echo_sendrecv(void)
+{
+	envid_t who;
+	uint32_t i;
+
+	for (;;) {
+		i = ipc_recv(&who, 0, 0);
+		ipc_send(who, i + 1, 0, 0);
+	}
+}
+
+static void
+echo_replywait(void)
+{
+	envid_t who = 0;
+	uint32_t i = 0;
+
+	for (;;)
+		i = ipc_reply_wait(who, i + 1, 0, 0, &who, 0, 0);
+}
+
+// Cycles per round trip with a child running echo
+static uint32_t
+run(void (*echo)(void), int call)
+{
+	uint64_t start;
+	envid_t who;
+	uint32_t i, r;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0)
+		echo();
+
+	start = read_tsc();
+	for (i = 0; i < NROUND; i++) {
+		if (call)
+			r = ipc_call(who, i, 0, 0, 0, 0);
+		else {
+			ipc_send(who, i, 0, 0);
+			r = ipc_recv(0, 0, 0);
+		}
+		if (r != i + 1)
+			panic("round %d: got %d back", i, r);
+	}
+	start = read_tsc() - start;
+	sys_env_destroy(who);
+	return start / NROUND;
+}
+
+void
+umain(int argc, char **argv)
+{
+	// The child inherits our affinity, so both run on CPU 0
+	sys_env_set_affinity(0, 1);
+	cprintf("send/recv: %u cycles per round trip\n",
+		run(echo_sendrecv, 0));
+	cprintf("call/reply_wait: %u cycles per round trip\n",
+		run(echo_replywait, 1));
+}
@@ -0,0 +1,81 @@
+// Scheduler benchmark: context-switch cost with many runnable envs, in
+// the style of stresssched, and how evenly CPU time is shared between
+// spinning envs, in the style of fairness.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCHILD	64
+#define NYIELD	100
+#define SPINMS	1000
+
+// Shared with the children: one spin counter per child
+static volatile uint32_t *counts = (volatile uint32_t *) 0xd0000000;
+
+static void
+wait_children(envid_t *kids, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		while (envs[ENVX(kids[i])].env_id == kids[i]
+		       && envs[ENVX(kids[i])].env_status != ENV_FREE)
+			sys_yield();
+}
+
+static void
+bench_yield(void)
+{
+	envid_t kids[NCHILD];
+	uint64_t start;
+	int i, j;
+
+	start = read_tsc();
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			for (j = 0; j < NYIELD; j++)
+				sys_yield();
+			exit();
+		}
+	}
+	wait_children(kids, NCHILD);
+	cprintf("%d envs x %d yields: %u cycles per yield\n", NCHILD, NYIELD,
+		(uint32_t) ((read_tsc() - start) / (NCHILD * NYIELD)));
+}
+
+static void
+bench_fairness(void)
+{
+	envid_t kids[NCHILD];
+	uint32_t min = ~0, max = 0, end;
+	int i, r;
+
+	if ((r = sys_page_alloc(0, (void *) counts, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	end = sys_time_msec() + SPINMS;
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			while (sys_time_msec() < end)
+				counts[i]++;
+			exit();
+		}
+	}
+	wait_children(kids, NCHILD);
+	for (i = 0; i < NCHILD; i++) {
+		min = MIN(min, counts[i]);
+		max = MAX(max, counts[i]);
+	}
+	cprintf("%d spinning envs for %d ms: min %u max %u iterations\n",
+		NCHILD, SPINMS, min, max);
+}
+
+void
+umain(int argc, char **argv)
+{
+	bench_yield();
+	bench_fairness();
+}
@@ -0,0 +1,87 @@
+// Syscall throughput benchmark: one env pinned to each of 1, 2, 4, ...
+// CPUs makes the same syscall in a loop.  sys_getenvid is served
+// without the big kernel lock, so its throughput should grow with the
+// number of CPUs; sys_page_unmap of an unmapped page takes the lock and
+// shows what serialization costs.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NCALL	100000
+#define NOPAGE	((void *) 0xd0001000)
+
+// Shared with the children
+struct bench {
+	volatile int go;	// Set once every child is ready
+	volatile int ready;	// Children that are waiting for go
+	volatile int done;	// Children that have finished
+};
+static struct bench *b = (struct bench *) 0xd0000000;
+
+static int
+count_cpus(void)
+{
+	int n;
+
+	for (n = 1; n < 32; n++)
+		if (sys_env_set_affinity(0, 1u << n) < 0)
+			break;
+	sys_env_set_affinity(0, ~0);
+	return n;
+}
+
+static void
+child(int cpu, int locked)
+{
+	int i;
+
+	sys_env_set_affinity(0, 1u << cpu);
+	sys_yield();
+	__sync_fetch_and_add(&b->ready, 1);
+	while (!b->go)
+		;
+	for (i = 0; i < NCALL; i++)
+		if (locked)
+			sys_page_unmap(0, NOPAGE);
+		else
+			sys_getenvid();
+	__sync_fetch_and_add(&b->done, 1);
+	exit();
+}
+
+// Calls per million cycles, summed over ncpu CPUs
+static uint32_t
+run(int ncpu, int locked)
+{
+	uint64_t start;
+	envid_t id;
+	int i;
+
+	b->go = b->ready = b->done = 0;
+	for (i = 0; i < ncpu; i++) {
+		if ((id = fork()) < 0)
+			panic("fork: %e", id);
+		if (id == 0)
+			child(i, locked);
+	}
+	while (b->ready < ncpu)
+		sys_yield();
+	start = read_tsc();
+	b->go = 1;
+	while (b->done < ncpu)
+		sys_yield();
+	return (uint64_t) ncpu * NCALL * 1000000 / (read_tsc() - start);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int n, ncpu, r;
+
+	if ((r = sys_page_alloc(0, b, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	ncpu = count_cpus();
+	for (n = 1; n <= ncpu; n *= 2)
+		cprintf("%d CPUs: getenvid %u, page_unmap %u calls per Mcycle\n",
+			n, run(n, 0), run(n, 1));
+}
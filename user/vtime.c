@@ -0,0 +1,38 @@
+// Test the user-mapped time page: time_msec() must agree with
+// sys_time_msec(), and time_nsec() must never run backwards.  Then
+// check that sys_sleep_until sleeps until its deadline.
+
+#include <inc/lib.h>
+#include <inc/time.h>
+
+#define SLEEP_NSEC	(50 * NSEC_PER_MSEC)
+
+void
+umain(int argc, char **argv)
+{
+	unsigned int ms, sys;
+	uint64_t ns, last = 0;
+	int i;
+
+	for (i = 0; i < 100000; i++) {
+		ns = time_nsec();
+		if (ns < last)
+			panic("time_nsec went backwards: %llu after %llu", ns, last);
+		last = ns;
+	}
+
+	ms = time_msec();
+	sys = sys_time_msec();
+	if (sys < ms || sys - ms > 10)
+		panic("time_msec %u but sys_time_msec %u", ms, sys);
+	if (last / NSEC_PER_MSEC > sys + 10)
+		panic("time_nsec %llu ahead of sys_time_msec %u", last, sys);
+
+	if (sys_sleep_until(last) != 0)
+		panic("sys_sleep_until a past deadline failed");
+	ns = time_nsec() + SLEEP_NSEC;
+	sys_sleep_until(ns);
+	if (time_nsec() < ns)
+		panic("sys_sleep_until woke %llu ns early", ns - time_nsec());
+	cprintf("vtime OK\n");
+}